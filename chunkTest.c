@@ -0,0 +1,63 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "myAllocator.h"
+#include <assert.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define NUM_BLOCKS 2000
+#define NUM_SMALL 300000                /* of 4000 bytes: past an arena's 1G reservation */
+
+void *blocks[NUM_BLOCKS];
+char *small[NUM_SMALL];
+
+#define MPOL_PREFERRED 1        /* from <numaif.h>, which may not be installed */
+#define MPOL_F_ADDR 2
+
+int policyAt(void *addr) {      /* the NUMA policy of addr's page */
+  int mode = -1;
+  syscall(SYS_get_mempolicy, &mode, 0, 0, addr, MPOL_F_ADDR);
+  return mode;
+}
+
+int main() 
+{
+  size_t before, grown, page = sysconf(_SC_PAGESIZE);
+  unsigned long node0 = 1;
+  int i;
+  void *big, *again, *tail;
+  printf("arena grows in doubling steps, trims its free tail\n"); /* stdout's buffer */
+  before = allocatorSyscalls();
+  for (i = 0; i < NUM_BLOCKS; i++) /* ~200M of arena, committed in growing steps */
+    blocks[i] = malloc(100000);
+  grown = allocatorSyscalls();
+  printf("growing to %dk took %lu system calls\n",
+	 NUM_BLOCKS * 100000 / 1024, (unsigned long)(grown - before));
+  tail = (void *)(((size_t)blocks[NUM_BLOCKS - 1] + page - 1) & ~(page - 1));
+  assert(syscall(SYS_mbind, tail, page, MPOL_PREFERRED, &node0, 2, 0) == 0); /* as on a node */
+  for (i = 0; i < NUM_BLOCKS; i++)
+    free(blocks[i]);
+  assert(policyAt(tail) == MPOL_PREFERRED); /* decommitted, still bound */
+  printf("freeing everything (trimming the arena) took %lu system calls\n",
+	 (unsigned long)(allocatorSyscalls() - grown));
+
+  big = malloc(8 << 20);        /* mapped block; goes to the chunk cache when freed */
+  free(big);
+  before = allocatorSyscalls();
+  again = malloc(7 << 20);
+  assert(again == big);         /* reused, not mapped anew */
+  assert(allocatorSyscalls() == before);
+  free(again);
+  printf("cached chunk reused without system calls\n");
+
+  for (i = 0; i < NUM_SMALL; i++) { /* the node's next arena takes over */
+    small[i] = malloc(4000);
+    assert(small[i] != 0);
+    small[i][0] = small[i][3999] = 1;
+  }
+  for (i = 0; i < NUM_SMALL; i++)
+    free(small[i]);
+  printf("%dM of small blocks from one node\n", (int)((size_t)NUM_SMALL * 4000 >> 20));
+  arenaCheck();
+  return 0;
+}
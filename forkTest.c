@@ -0,0 +1,192 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "myAllocator.h"
+#include <assert.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+/* fork while other threads allocate, allocate where an arena is
+   locked (a hook) or may be (signal handlers), and run out of memory */
+
+#define NUM_THREADS 4
+#define NUM_FORKS 100
+#define NUM_SIGNALS 2000
+#define MAX_KEPT 100000
+
+volatile int stop = 0;
+volatile int handled = 0, handlerFailures = 0;
+void *volatile inHook = 0;       /* set by hooks that mallocs call */
+void *freedInHook = 0, *hugeInHook = &hugeInHook;
+volatile size_t huge = (size_t)-16;
+volatile int fails = 0;
+void *volatile kept[NUM_THREADS + 1]; /* or the compiler drops malloc & free pairs */
+void *leaked[MAX_KEPT];
+
+void *churn(void *slot) {       /* keeps every lock busy */
+  unsigned int seed = 1;
+  while (!stop) {
+    kept[(long)slot] = malloc(rand_r(&seed) % 3 ? rand_r(&seed) % 2000 : 300000);
+    free(kept[(long)slot]);
+  }
+  return slot;
+}
+
+void forkUnderLoad() {
+  pthread_t threads[NUM_THREADS];
+  int i, status;
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_create(&threads[i], 0, churn, (void *)(long)(i + 1));
+  for (i = 0; i < NUM_FORKS; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {             /* would hang on a lock its parent's threads held */
+      alarm(10);
+      kept[0] = malloc(100);
+      free(kept[0]);
+      kept[0] = malloc(300000);
+      free(kept[0]);
+      kept[0] = malloc(5000);
+      free(kept[0]);
+      _exit(0);
+    }
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  stop = 1;
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_join(threads[i], 0);
+}
+
+void allocateInHook(int event, int node, size_t size, size_t extra) {
+  if (event == ALLOC_EVENT_SPLIT && inHook == 0) { /* its arena is locked */
+    inHook = malloc(100);
+    hugeInHook = malloc(huge);  /* the pool's, if its size wrapped */
+    free(freedInHook);          /* an arena block: freed later */
+  }
+}
+
+void onSignal(int sig) {        /* often lands inside malloc or free */
+  char *volatile r = malloc(200);
+  if (r == 0)
+    handlerFailures++;
+  else {
+    memset(r, sig, 200);
+    free(r);
+  }
+  handled++;
+}
+
+void allocateInSignals() {
+  struct itimerval every = { { 0, 50 }, { 0, 50 } }, off = { { 0, 0 }, { 0, 0 } };
+  void *regions[64] = { 0 };
+  int i = 0;
+  signal(SIGALRM, onSignal);
+  setitimer(ITIMER_REAL, &every, 0);
+  while (handled < NUM_SIGNALS) {
+    free(regions[i % 64]);
+    regions[i % 64] = malloc(i % 2 ? i % 4000 : 16);
+    i++;
+  }
+  setitimer(ITIMER_REAL, &off, 0);
+  for (i = 0; i < 64; i++)
+    free(regions[i]);
+  assert(handlerFailures == 0);
+}
+
+void countFail(int event, int node, size_t size, size_t extra) {
+  if (event == ALLOC_EVENT_FAIL)
+    fails++;
+}
+
+void allocateAfterFailing(int event, int node, size_t size, size_t extra) {
+  if (event == ALLOC_EVENT_FAIL)
+    fails++;
+  else if (event == ALLOC_EVENT_SPLIT && inHook == 0)
+    inHook = malloc(5000);      /* the pool's blocks out of memory mallocs left */
+}
+
+void runOutOfMemory() {         /* in a child: the limit stays there */
+  struct rlimit limit = { 64 << 20, 64 << 20 };
+  void *r;
+  int status, i;
+  pid_t pid = fork();
+  if (pid == 0) {
+    setAllocHook(countFail);
+    assert(setrlimit(RLIMIT_DATA, &limit) == 0);
+    while (fails == 0)          /* leaks everything until the arena can't grow */
+      assert(malloc(5000) != 0);
+    r = malloc(5000);           /* the emergency pool's */
+    assert(r != 0 && usableSpaceRegion(r) >= 5000);
+    memset(r, 1, 5000);
+    free(r);
+    while (malloc(5000) != 0)   /* leaks the pool's blocks too */
+      ;
+    inHook = 0;
+    setAllocHook(allocateAfterFailing);
+    free(r = malloc(1000));     /* (arena or pool) */
+    for (i = 0; i < 1000 && inHook == 0; i++)
+      kept[0] = malloc(100);    /* until one splits a block */
+    assert(inHook != 0);
+    _exit(0);
+  }
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+void runOutOfIndex() {          /* frees need index entries, when there's no memory left */
+  struct rlimit limit = { 64 << 20, 64 << 20 };
+  size_t len;
+  int status, i, n = 0;
+  pid_t pid = fork();
+  if (pid == 0) {
+    setAllocHook(countFail);
+    fails = 0;
+    assert(setrlimit(RLIMIT_DATA, &limit) == 0);
+    while (fails == 0 && n < MAX_KEPT)
+      leaked[n++] = malloc(300); /* too big for thread caches */
+    assert(n < MAX_KEPT);
+    for (len = 64 << 20; len >= 4096; len /= 2) /* take whatever is left */
+      while (mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) != MAP_FAILED)
+	;
+    for (i = 0; i < n; i += 2)  /* each one a free block of its own */
+      free(leaked[i]);
+    dup2(open("/dev/null", O_WRONLY), 2); /* arenaCheck()'s many lines */
+    arenaCheck();
+    _exit(0);
+  }
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main()
+{
+  int i;
+  printf("fork, signal handlers & running out of memory\n"); /* stdout's buffer */
+  forkUnderLoad();
+  printf("%d forks while %d threads allocate\n", NUM_FORKS, NUM_THREADS);
+
+  freedInHook = malloc(1000);
+  setAllocHook(allocateInHook);
+  for (i = 0; i < 100 && inHook == 0; i++) {
+    kept[0] = malloc(100000);   /* splits a block */
+    free(kept[0]);
+  }
+  setAllocHook(0);
+  assert(inHook != 0 && hugeInHook == 0);
+  memset(inHook, 1, 100);
+  free(inHook);
+  kept[0] = malloc(1000);
+  free(kept[0]);                /* and freedInHook with it */
+  arenaCheck();
+
+  allocateInSignals();
+  printf("%d signal handlers allocated\n", handled);
+  runOutOfMemory();
+  printf("out of memory, still allocated\n");
+  runOutOfIndex();
+  printf("out of memory, still freed\n");
+  return 0;
+}
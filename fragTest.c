@@ -0,0 +1,50 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "myAllocator.h"
+#include "sizeClasses.h"
+#include <assert.h>
+#include <malloc.h>
+
+#define NUM_REGIONS 16
+
+void *regions[NUM_REGIONS];
+
+void printStats(const char *when) {
+  FragmentationStats_t st;
+  fragmentationStats(&st);
+  printf("%s: requested=%luk internal=%luk free=%luk in %lu blocks, external=%luk\n", when,
+	 (unsigned long)st.requested / 1024, (unsigned long)st.internal / 1024,
+	 (unsigned long)st.free / 1024, (unsigned long)st.freeBlocks,
+	 (unsigned long)st.external / 1024);
+}
+
+int main() 
+{
+  size_t s;
+  int i;
+  double worst = 0;
+  printStats("start");
+  for (s = 33; s < 300000; s += s / 8 + 1) { /* how much does rounding waste? */
+    void *p = malloc(s);
+    size_t usable = malloc_usable_size(p);
+    assert(usable >= s && usable < 2 * s + 40); /* 40: too small to split off */
+    if ((double)(usable - s) / s > worst)
+      worst = (double)(usable - s) / s;
+    free(p);
+  }
+  printf("size classes waste at most %.0f%% of a request\n", worst * 100);
+  assert(worst <= 1.0 / (1 << LG_CLASSES_PER_DOUBLING) /* n classes per doubling: 1/n */
+	 || worst < 8.0 / 33);  /* or classes only 8 bytes apart */
+  for (i = 0; i < NUM_REGIONS; i++) /* descending sizes, as in myTestCases */
+    regions[i] = malloc(65512 - 8 * i);
+  for (i = 1; i < NUM_REGIONS; i += 2)
+    free(regions[i]);
+  printStats("every other region freed");
+  for (i = 1; i < NUM_REGIONS; i += 2) /* same class: the holes fit exactly */
+    regions[i] = malloc(65512 - 8 * (NUM_REGIONS - i));
+  printStats("holes refilled");
+  for (i = 0; i < NUM_REGIONS; i++)
+    free(regions[i]);
+  arenaCheck();
+  return 0;
+}
@@ -0,0 +1,163 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "myAllocator.h"
+#include <assert.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/* a heap file survives its process: "write" fills one, "check" (a
+   new process) finds everything again through heapRoot(), also after
+   a process died growing it or "moved" found it elsewhere and fixed
+   its pointers; "ignore" is given a corrupt one */
+
+#define HEAP_FILE "heapTest.heap"
+#define NUM_NODES 1000
+
+typedef struct Node_s {
+  struct Node_s *next;
+  int value;
+  char text[60];
+} Node_t;
+
+typedef struct Root_s {
+  Node_t *first;
+  char *big;                    /* above MMAP_THRESHOLD, still in the file */
+} Root_t;
+
+int writeHeap() {
+  Root_t *root = malloc(sizeof(Root_t));
+  int i;
+  root->first = 0;
+  for (i = 0; i < NUM_NODES; i++) {
+    Node_t *n = malloc(sizeof(Node_t));
+    n->value = i;
+    sprintf(n->text, "node %d", i);
+    n->next = root->first;
+    root->first = n;
+    free(malloc(100 + i));      /* leave some freed blocks behind too */
+  }
+  root->big = malloc(1 << 20);
+  memset(root->big, 'x', 1 << 20);
+  assert(setHeapRoot(root));
+  return 0;
+}
+
+int checkHeap() {
+  Root_t *root = heapRoot();
+  Node_t *n;
+  char text[60];
+  int i = NUM_NODES;
+  void *more[100];
+  assert(root != 0 && heapMoved() == 0);
+  for (n = root->first; n; n = n->next) { /* still linked, still at the same place */
+    i--;
+    sprintf(text, "node %d", i);
+    assert(n->value == i && strcmp(n->text, text) == 0);
+  }
+  assert(i == 0);
+  for (i = 0; i < 1 << 20; i++)
+    assert(root->big[i] == 'x');
+  if (fork() == 0) {            /* a child's copy of the heap is its own */
+    memset(root->big, 'y', 1 << 20);
+    root->first->value = -1;
+    _exit(root->big[0] == 'y' ? 0 : 1);
+  }
+  assert(wait(&i) > 0 && WIFEXITED(i) && WEXITSTATUS(i) == 0);
+  assert(root->big[0] == 'x' && root->big[(1 << 20) - 1] == 'x'
+	 && root->first->value == NUM_NODES - 1);
+  for (i = 0; i < 100; i++)     /* the reopened heap keeps working */
+    more[i] = malloc(50 * i + 1);
+  assert(malloc(((size_t)1 << 32) + 64) == 0); /* not 64 bytes from a small free block */
+  for (i = 0; i < 100; i++)
+    free(more[i]);
+  arenaCheck();
+  return 0;
+}
+
+int ignoreHeap() {              /* a corrupt heap is left alone */
+  void *r = malloc(100);
+  assert(heapRoot() == 0 && r != 0);
+  free(r);
+  return 0;
+}
+
+/* the file's header is a page: 8 bytes of magic, then the length of
+   its blocks, the root's offset and the heap's address; the first
+   block's size (suffixOffset) starts the next page */
+size_t readField(off_t offset) {
+  size_t value = 0;
+  int fd = open(HEAP_FILE, O_RDONLY);
+  assert(pread(fd, &value, sizeof(value), offset) == sizeof(value));
+  close(fd);
+  return value;
+}
+
+void writeField(off_t offset, size_t value) {
+  int fd = open(HEAP_FILE, O_RDWR);
+  assert(pwrite(fd, &value, sizeof(value), offset) == sizeof(value));
+  close(fd);
+}
+
+int moveHeap() {                /* its old address taken: fix the pointers in it */
+  void *base = (void *)readField(24); /* before the first malloc maps it */
+  Root_t *root;
+  Node_t **n;
+  ptrdiff_t moved;
+  assert(mmap(base, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) == base);
+  root = heapRoot();
+  moved = heapMoved();
+  assert(root != 0 && moved != 0);
+  root->big += moved;
+  for (n = &root->first; *n; n = &(*n)->next)
+    *n = (Node_t *)((char *)*n + moved);
+  assert(root->first->value == NUM_NODES - 1 && root->big[0] == 'x');
+  return 0;
+}
+
+int run(char *self, char *phase) { /* phase in a new process using the heap file */
+  char *argv[] = { self, phase, 0 };
+  char *envp[] = { "MYALLOC_HEAP_FILE=" HEAP_FILE, 0 };
+  int status;
+  pid_t pid = fork();
+  if (pid == 0) {
+    execve(self, argv, envp);
+    _exit(127);
+  }
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, char **argv) 
+{
+  size_t page = sysconf(_SC_PAGESIZE), length, size;
+  if (argc > 1 && strcmp(argv[1], "write") == 0)
+    return writeHeap();
+  if (argc > 1 && strcmp(argv[1], "check") == 0)
+    return checkHeap();
+  if (argc > 1 && strcmp(argv[1], "ignore") == 0)
+    return ignoreHeap();
+  if (argc > 1 && strcmp(argv[1], "moved") == 0)
+    return moveHeap();
+  unlink(HEAP_FILE);
+  assert(run(argv[0], "write") == 0);
+  assert(run(argv[0], "check") == 0);
+  assert(run(argv[0], "check") == 0); /* and again, after check's own changes */
+  length = readField(8);        /* died after growing the file, before writing the block */
+  writeField(8, length + (1 << 20));
+  assert(truncate(HEAP_FILE, page + length + (1 << 20)) == 0);
+  assert(run(argv[0], "check") == 0 && readField(8) == length);
+  size = readField(page);
+  writeField(page, (size_t)1 << 40); /* a block past the end of the file */
+  assert(run(argv[0], "ignore") == 0);
+  assert(readField(page) == (size_t)1 << 40); /* not "repaired" either */
+  writeField(page, size);
+  assert(run(argv[0], "check") == 0);
+  assert(run(argv[0], "moved") == 0);
+  assert(run(argv[0], "check") == 0); /* at its new address */
+  unlink(HEAP_FILE);
+  printf("heap file reopened with all allocations intact\n");
+  return 0;
+}
@@ -0,0 +1,52 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "myAllocator.h"
+#include <assert.h>
+
+/* the slow paths report through the hook, the fast ones don't */
+
+#define NUM_BLOCKS 400
+
+size_t events[NUM_ALLOC_EVENTS];
+void *blocks[NUM_BLOCKS];
+
+void countEvent(int event, int node, size_t size, size_t extra) {
+  events[event]++;              /* no allocating in here */
+}
+
+int main() 
+{
+  LatencyHistogram_t h;
+  void *r;
+  int i, e;
+  printf("allocator events reach the hook\n"); /* stdout's buffer */
+  assert(setAllocHook(countEvent) == 0);
+  for (i = 0; i < NUM_BLOCKS; i++) /* ~40M: grows the arena, splitting its free end */
+    blocks[i] = malloc(100000);
+  assert(events[ALLOC_EVENT_GROW] > 0 && events[ALLOC_EVENT_SPLIT] > 0);
+  takeAllocEvents();            /* the thread's events, straight from the allocator */
+  r = allocRegion(100000);
+  assert(takeAllocEvents() & (1 << ALLOC_EVENT_SPLIT));
+  assert(takeAllocEvents() == 0);
+  freeRegion(r);
+  for (i = 0; i < NUM_BLOCKS; i++)
+    free(blocks[i]);
+  assert(events[ALLOC_EVENT_COALESCE] > 0 && events[ALLOC_EVENT_TRIM] > 0);
+  assert(malloc((size_t)1 << 50) == 0); /* no room anywhere */
+  assert(events[ALLOC_EVENT_FAIL] == 1);
+  assert(setAllocHook(0) == countEvent);
+  for (e = 0; e < NUM_ALLOC_EVENTS; e++)
+    printf("event %d: %lu\n", e, (unsigned long)events[e]);
+
+  if (mallocLatencyStats(&h)) { /* built with LATENCY=1 */
+    size_t mallocs = 0, slow = 0;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+      mallocs += h.count[MALLOC_OP_MALLOC][i];
+      slow += h.withEvent[MALLOC_OP_MALLOC][ALLOC_EVENT_GROW][i];
+    }
+    assert(mallocs >= NUM_BLOCKS + 1 && slow > 0);
+    printf("%lu mallocs timed, %lu of them grew the arena\n",
+	   (unsigned long)mallocs, (unsigned long)slow);
+  }
+  return 0;
+}
@@ -0,0 +1,58 @@
+#include "stdio.h"
+#include "stdlib.h"
+
+/*
+  Writes sizeClasses.h, the allocator's size class table, to stdout.
+
+  usage: makeSizeClasses.exe [classesPerDoubling]
+
+  Classes are 8 bytes apart up to 8*classesPerDoubling; after that
+  every power of two interval (2^k, 2^(k+1)] is split into
+  classesPerDoubling classes (8, 16, 24, 32, 40, 48, 56, 64, 80, 96 ...
+  for the default of 4).  Sizes up to LOOKUP_MAX are mapped to their
+  class through sizeClassOf[]; bigger ones are computed (see
+  sizeClass() in myAllocator.c).  The largest class is 2^LG_MAX_CLASS,
+  which must be MMAP_THRESHOLD: anything bigger gets its own mapping.
+*/
+
+#define LG_LOOKUP_MAX 12                /* 4K */
+#define LG_MAX_CLASS 18                 /* 256K */
+
+int main(int argc, char **argv)
+{
+  int perDoubling = argc > 1 ? atoi(argv[1]) : 4;
+  int lgPerDoubling = 0, numClasses = 0, c;
+  size_t sizes[1024], size, spacing;
+
+  while ((1 << lgPerDoubling) < perDoubling)
+    lgPerDoubling++;
+  if (perDoubling < 1 || perDoubling > 32 || (1 << lgPerDoubling) != perDoubling) {
+    fprintf(stderr, "classes per doubling must be a power of 2 from 1 to 32\n");
+    return 1;
+  }
+  for (size = 8; size <= 8 * (size_t)perDoubling; size += 8)
+    sizes[numClasses++] = size;
+  for (size -= 8; size < (1 << LG_MAX_CLASS); ) {
+    spacing = size / perDoubling;
+    for (c = 0; c < perDoubling; c++)
+      sizes[numClasses++] = size += spacing;
+  }
+
+  printf("/* generated by makeSizeClasses.exe %d -- do not edit */\n\n", perDoubling);
+  printf("#define LG_CLASSES_PER_DOUBLING %d\n", lgPerDoubling);
+  printf("#define LG_LOOKUP_MAX %d\n", LG_LOOKUP_MAX);
+  printf("#define LOOKUP_MAX %d\n", 1 << LG_LOOKUP_MAX);
+  printf("#define NUM_SIZE_CLASSES %d\n\n", numClasses);
+  printf("static const size_t sizeClassSize[NUM_SIZE_CLASSES] = {");
+  for (c = 0; c < numClasses; c++)
+    printf("%s%lu,", c % 8 ? " " : "\n  ", (unsigned long)sizes[c]);
+  printf("\n};\n\n");
+  printf("static const unsigned char sizeClassOf[LOOKUP_MAX / 8 + 1] = { /* by (s + 7) / 8 */");
+  for (size = 0, c = 0; size <= (1 << LG_LOOKUP_MAX); size += 8) {
+    while (sizes[c] < size)
+      c++;
+    printf("%s%d,", size % 128 ? " " : "\n  ", c);
+  }
+  printf("\n};\n");
+  return 0;
+}
@@ -2,30 +2,107 @@
 
 #include "myAllocator.h"
 #include "string.h"
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #define align4(x) ((x+3) & ~3)
 #define align8(x) ((x+7) & ~7)
 
+#ifndef MALLOC_LATENCY
+#define MALLOC_LATENCY 0                /* 1: keep latency histograms */
+#endif
+
+/* latency histograms: each malloc, free & realloc is timed and
+   counted in a power-of-two bucket, and again under each allocator
+   event (see takeAllocEvents()) that happened during it */
+
+LatencyHistogram_t latency;
+
+static inline unsigned long long readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else                           /* no cycle counter: nanoseconds instead */
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+static inline void noteLatency(int op, unsigned long long start) {
+  unsigned long long cycles = readCycles() - start;
+  unsigned int events = takeAllocEvents();
+  int bucket = cycles ? 64 - __builtin_clzll(cycles) : 0;
+  int e;
+  if (bucket >= LATENCY_BUCKETS)
+    bucket = LATENCY_BUCKETS - 1;
+  __sync_fetch_and_add(&latency.count[op][bucket], 1);
+  for (e = 0; events; e++, events >>= 1)
+    if (events & 1)
+      __sync_fetch_and_add(&latency.withEvent[op][e][bucket], 1);
+}
+
+int mallocLatencyStats(LatencyHistogram_t *h) { /* copy of the histograms so far */
+  if (!MALLOC_LATENCY)
+    return 0;
+  memcpy(h, &latency, sizeof(*h));
+  return 1;
+}
+
 /* first, the standard malloc functions */
 
-void *malloc(size_t NBYTES) {
-  return firstFitAllocRegion(NBYTES);
+void *malloc(size_t NBYTES) {   /* fit policy is chosen by ALLOC_POLICY */
+  if (MALLOC_LATENCY) {
+    unsigned long long start = readCycles();
+    void *r;
+    takeAllocEvents();          /* forget events from outside malloc & co */
+    r = allocRegion(NBYTES);
+    noteLatency(MALLOC_OP_MALLOC, start);
+    return r;
+  }
+  return allocRegion(NBYTES);
 }
 
 
 
 void *realloc(void *APTR, size_t NBYTES) {
-  return resizeRegion(APTR, NBYTES);
+  if (MALLOC_LATENCY) {
+    unsigned long long start = readCycles();
+    void *r;
+    takeAllocEvents();
+    r = reallocRegion(APTR, NBYTES);
+    noteLatency(MALLOC_OP_REALLOC, start);
+    return r;
+  }
+  return reallocRegion(APTR, NBYTES);
+}
+
+void free(void *APTR) {
+  if (MALLOC_LATENCY) {
+    unsigned long long start = readCycles();
+    takeAllocEvents();
+    freeRegion(APTR);
+    noteLatency(MALLOC_OP_FREE, start);
+    return;
+  }
+  freeRegion(APTR);
 }
 
-void free(void *APTR) { freeRegion(APTR); }
+void *malloc_on_node(size_t NBYTES, int NODE) { /* memory local to NUMA node NODE */
+  return nodeAllocRegion(NBYTES, NODE);
+}
+
+void *malloc_shared(size_t NBYTES) { /* from the arena shared with shareArena() */
+  return sharedAllocRegion(NBYTES);
+}
 
 void *memalign(size_t ALIGN, size_t NBYTES) { /* ignore ALIGN -- hack -- */
   void *p = malloc(NBYTES+ALIGN); 
   return p;
 }
 
-size_t malloc_usable_size(void *APTR) { return computeUsableSpace(regionToPrefix(APTR)); }
+size_t malloc_usable_size(void *APTR) { return usableSpaceRegion(APTR); }
 
 
 /* some systems require that malloc replacements provide these... */
@@ -0,0 +1,95 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "myAllocator.h"
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* cycles per malloc & per free; build with "make bench POLICY=findBestFit"
+   (after "make clean") to measure another fit policy */
+
+#define ROUNDS 100
+#define MAX_BATCH 1000
+
+void *regions[MAX_BATCH];
+
+unsigned long long readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else                           /* no cycle counter: nanoseconds instead */
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+/* malloc batch regions of minSize..maxSize bytes, then free them all */
+void measure(const char *name, int batch, size_t minSize, size_t maxSize) {
+  unsigned long long mallocCycles = 0, freeCycles = 0, t;
+  int round, i;
+  srand(1);
+  for (round = -1; round < ROUNDS; round++) { /* round -1 warms up, untimed */
+    t = readCycles();
+    for (i = 0; i < batch; i++)
+      regions[i] = malloc(minSize + rand() % (maxSize - minSize + 1));
+    if (round >= 0)
+      mallocCycles += readCycles() - t;
+    t = readCycles();
+    for (i = 0; i < batch; i++)
+      free(regions[i]);
+    if (round >= 0)
+      freeCycles += readCycles() - t;
+  }
+  printf("%-24s %8.1f cycles/malloc %8.1f cycles/free\n", name,
+	 (double)mallocCycles / (ROUNDS * batch), (double)freeCycles / (ROUNDS * batch));
+}
+
+/* after "make clean bench LATENCY=1": percentiles of every malloc &
+   free timed above, and which allocator events the slowest 0.1% hit */
+void reportLatency() {
+  static const char *ops[] = { "malloc", "free", "realloc" };
+  static const char *events[] = { "grow", "fail", "trim", "split", "coalesce" };
+  LatencyHistogram_t h;
+  int op, b, e;
+  if (!mallocLatencyStats(&h))
+    return;
+  for (op = 0; op < NUM_MALLOC_OPS; op++) {
+    size_t total = 0, seen = 0, tail = 0, tailEvents[NUM_ALLOC_EVENTS] = { 0 };
+    int p50 = -1, p99 = -1, p999 = -1;
+    for (b = 0; b < LATENCY_BUCKETS; b++)
+      total += h.count[op][b];
+    if (total == 0)
+      continue;
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+      seen += h.count[op][b];
+      if (p50 < 0 && seen >= total * 0.5)
+	p50 = b;
+      if (p99 < 0 && seen >= total * 0.99)
+	p99 = b;
+      if (p999 < 0 && seen >= total * 0.999)
+	p999 = b;
+    }
+    for (b = p999; b < LATENCY_BUCKETS; b++) { /* the tail, by event */
+      tail += h.count[op][b];
+      for (e = 0; e < NUM_ALLOC_EVENTS; e++)
+	tailEvents[e] += h.withEvent[op][e][b];
+    }
+    printf("%-8s p50 < %llu  p99 < %llu  p99.9 < %llu cycles; slowest ops hit:", ops[op],
+	   1ULL << p50, 1ULL << p99, 1ULL << p999);
+    for (e = 0; e < NUM_ALLOC_EVENTS; e++)
+      printf(" %s %.0f%%", events[e], 100.0 * tailEvents[e] / tail);
+    printf("\n");
+  }
+}
+
+int main() 
+{
+  measure("16 x 32 bytes", 16, 32, 32);
+  measure("16 small (8-64 bytes)", 16, 8, 64);
+  measure("1000 small (8-64 bytes)", 1000, 8, 64);
+  measure("1000 small (8-256 bytes)", 1000, 8, 256);
+  measure("1000 medium (1k-16k)", 1000, 1024, 16384);
+  reportLatency();
+  return 0;
+}
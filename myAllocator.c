@@ -1,8 +1,21 @@
+#define _GNU_SOURCE             /* for mremap() */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include "myAllocator.h"
+#include "sizeClasses.h"            /* generated, see makeSizeClasses.c */
 
 /*
   This is a simple endogenous first-fit allocator.  
@@ -45,16 +58,55 @@
   marks the region's allocated block as free and attempts to coalesce
   it with its neighbors.
 
+  Requests of at least MMAP_THRESHOLD bytes are not carved from the
+  arena.  Each gets its own anonymous mapping holding a single block
+  whose prefix is marked BLOCK_MAPPED (see mapAllocRegion()).  Such
+  blocks are returned to the kernel when freed and are resized with
+  mremap(), so growing them moves page table entries rather than
+  copying data.  reallocRegion() tries resizeRegion() first and
+  otherwise moves the region, reserving extra room (see
+  reallocGrowthSize()) so that repeated growth is amortized.
+
+  There is one arena per NUMA node, each protected by its own lock.
+  A thread allocates from the arena of the node it is running on
+  (currentArena()), or from a given node's arena (nodeAllocRegion()).
+  A freed block always goes back to the arena holding it (arenaOf()),
+  whichever thread frees it.  Arena memory is mmap()ed and bound to
+  its node with mbind().  Setting MYALLOC_NUMA_NODES=n in the
+  environment simulates n nodes (cpu c belongs to node c % n) and
+  binds nothing, so the per-node paths can be exercised on a
+  single-node machine.
+
+  Each arena reserves ARENA_RESERVE bytes of address space up front
+  (PROT_NONE, so no memory is used) and commits pages from the front
+  of that reservation as it grows.  Every growth commits at least the
+  arena's commitStep, which doubles with each growth up to
+  MAX_COMMIT_STEP, so an arena that keeps growing makes O(log n)
+  system calls.  A large free tail is decommitted by trimArena() but
+  its address space stays reserved for later growth.  When a node's
+  reservation is used up, another arena with a reservation of its own
+  is chained to it (chainArena()) and allocation goes on there, so a
+  node's memory isn't limited to ARENA_RESERVE; offsets within each
+  arena still fit in an int.  Freed mappings
+  of BLOCK_MAPPED blocks are kept in a small cache (see cacheChunk())
+  and reused by later large requests instead of being unmapped.
+
 */
 
-/* block prefix & suffix */
+/* block prefix & suffix: offsets rather than pointers, so blocks
+   mean the same wherever their memory is mapped */
 typedef struct BlockPrefix_s {
-  struct BlockSuffix_s *suffix;
-  int allocated;
+  size_t suffixOffset;                  /* from prefix to suffix */
+  unsigned short allocated;
+  unsigned short node;                  /* BLOCK_MAPPED only: node of its pages */
+  union {
+    unsigned int slack;                 /* in use: usable space the request didn't need */
+    unsigned int freeIndex;             /* free: its entry in the arena's free index */
+  };
 } BlockPrefix_t;
 
 typedef struct BlockSuffix_s {
-  struct BlockPrefix_s *prefix;
+  size_t prefixOffset;                  /* back from suffix to prefix */
 } BlockSuffix_t;
 
 /* align everything to multiples of 8 */
@@ -62,149 +114,1088 @@ typedef struct BlockSuffix_s {
 #define prefixSize align8(sizeof(BlockPrefix_t))
 #define suffixSize align8(sizeof(BlockSuffix_t))
 
+static inline BlockSuffix_t *blockSuffix(BlockPrefix_t *p) {
+  return (void *)p + p->suffixOffset;
+}
+
+static inline BlockPrefix_t *suffixPrefix(BlockSuffix_t *s) {
+  return (void *)s - s->prefixOffset;
+}
+
+/* values of a prefix's allocated field */
+#define BLOCK_FREE 0
+#define BLOCK_ALLOCATED 1
+#define BLOCK_MAPPED 2                  /* block owns its own mapping */
+#define BLOCK_CACHED 3                  /* freed, held in a thread cache */
+#define BLOCK_EMERGENCY 4               /* in the emergency pool */
+
 /* how much memory to ask for */
 const size_t DEFAULT_BRKSIZE = 0x100000;        /* 1M */
+const size_t MAX_COMMIT_STEP = 0x1000000;       /* 16M */
+
+/* address space reserved for each arena (< 2G: see freeOffsets); a
+   node whose arena fills it chains another */
+const size_t ARENA_RESERVE = 0x40000000;        /* 1G */
+
+/* decommit an arena's free tail once it is this big */
+const size_t TRIM_THRESHOLD = 0x2000000;        /* 32M */
+
+/* requests at least this big get their own mapping */
+const size_t MMAP_THRESHOLD = 0x40000;          /* 256K */
+
+/* size classes: every arena request is rounded up to one of
+   sizeClassSize[] so that freed blocks fit later requests of the same
+   class instead of leaving odd-sized slivers.  The table is generated
+   at build time (CLASSES_PER_DOUBLING in the Makefile); 4 classes per
+   power of two bound rounding waste to 25% of a request (65 -> 80
+   bytes wastes 23%) */
+
+static inline int sizeClass(size_t s) { /* smallest class holding s, s <= MMAP_THRESHOLD */
+  int lg;
+  if (s <= LOOKUP_MAX)
+    return sizeClassOf[(s + 7) >> 3];
+  lg = 63 - __builtin_clzl(s - 1);      /* s is in (2^lg, 2^(lg+1)] */
+  return sizeClassOf[LOOKUP_MAX >> 3] + ((lg - LG_LOOKUP_MAX) << LG_CLASSES_PER_DOUBLING)
+    + (((s - 1) >> (lg - LG_CLASSES_PER_DOUBLING)) & ((1 << LG_CLASSES_PER_DOUBLING) - 1)) + 1;
+}
+
+static inline size_t roundRequest(size_t s) { /* what an arena actually allocates for s */
+  if (s >= MMAP_THRESHOLD)      /* mappings round to pages instead */
+    return s;
+  return sizeClassSize[sizeClass(s)];
+}
 
 /* create a block, mark it as free */
-BlockPrefix_t *makeFreeBlock(void *addr, size_t size) { 
+static inline BlockPrefix_t *makeFreeBlock(void *addr, size_t size) { 
   BlockPrefix_t *p = addr;
   void *limitAddr = addr + size;
   BlockSuffix_t *s = limitAddr - align8(sizeof(BlockSuffix_t));
-  p->suffix = s;
-  s->prefix = p;
+  p->suffixOffset = s->prefixOffset = (void *)s - addr;
   p->allocated = 0;
   return p;
 }
 
-/* lowest & highest address in arena (global vars) */
-BlockPrefix_t *arenaBegin = (void *)0;
-void *arenaEnd = 0;
+static inline size_t computeUsableSpace(BlockPrefix_t *p) { /* useful space within a block */
+  return p->suffixOffset - prefixSize;
+}
+
+static inline BlockPrefix_t *computeNextPrefixAddr(BlockPrefix_t *p) { 
+  return ((void *)blockSuffix(p)) + suffixSize;
+}
 
-/*this is used to keep track of which memory block we are currently on */
-BlockPrefix_t *nextFitTracker;
+static inline BlockSuffix_t *computePrevSuffixAddr(BlockPrefix_t *p) {
+  return ((void *)p) - suffixSize;
+}
 
+/* conversion between blocks & regions (offset of prefixSize */
 
-void initializeArena() {
-  if (arenaBegin != 0)     /* only initialize once */
-    return; 
-  arenaBegin = makeFreeBlock(sbrk(DEFAULT_BRKSIZE), DEFAULT_BRKSIZE);
-  arenaEnd = ((void *)arenaBegin) + DEFAULT_BRKSIZE;
-  nextFitTracker = areaBegin; 
+static inline BlockPrefix_t *regionToPrefix(void *r) {
+  if (r)
+    return r - prefixSize;
+  else
+    return 0;
+}
+
+static inline void *prefixToRegion(BlockPrefix_t *p) {
+  void * vp = p;
+  if (p)
+    return vp + prefixSize;
+  else
+    return 0;
 }
 
-size_t computeUsableSpace(BlockPrefix_t *p) { /* useful space within a block */
-  void *prefix_end = ((void*)p) + prefixSize;
-  return ((void *)(p->suffix)) - (prefix_end);
+size_t pageAlign(size_t s) {    /* round s up to a multiple of the page size */
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  return (s + pageSize - 1) & ~(pageSize - 1);
 }
 
-BlockPrefix_t *computeNextPrefixAddr(BlockPrefix_t *p) { 
-  return ((void *)(p->suffix)) + suffixSize;
+void writeMessage(const char *s) { /* to stderr; stdio might malloc */
+  ssize_t written = write(2, s, strlen(s));
+  (void)written;
 }
 
-BlockSuffix_t *computePrevSuffixAddr(BlockPrefix_t *p) {
-  return ((void *)p) - suffixSize;
+#define MAX_ARENAS 64                   /* at most one arena per node */
+
+#ifndef MPOL_PREFERRED                  /* <numaif.h> may not be installed */
+#define MPOL_PREFERRED 1
+#endif
+
+#define NEXT_FIT_CURSORS 16             /* threads share these round robin */
+
+/* the part of an arena every process using it must agree on */
+typedef struct ArenaState_s {
+  pthread_mutex_t lock;
+  size_t numFree;                       /* free index entries in use */
+  size_t numUsed;                       /* blocks allocated or cached */
+  size_t freeCommitted;                 /* entries backed by memory */
+  int cursors[NEXT_FIT_CURSORS];        /* next fit: offsets of blocks to search from */
+  int cursorsUsed;                      /* true: keep cursors on block boundaries */
+  int broken;                           /* a process died mid-change, beyond repair */
+} ArenaState_t;
+
+typedef struct Arena_s {
+  BlockPrefix_t *arenaBegin;            /* lowest & highest address in arena */
+  void *arenaEnd;                       /* end of committed pages */
+  size_t reserved;                      /* size of reservation at arenaBegin */
+  size_t commitStep;                    /* least to commit when growing */
+  int *freeSizes;                       /* free index: each free block's usable */
+  int *freeOffsets;                     /*   space & offset from arenaBegin */
+  struct HeapHeader_s *heap;            /* header of the arena's heap file, or 0 */
+  int heapFd;
+  int shared;                           /* true: other processes use it too */
+  int node;                             /* NUMA node backing the arena */
+  ArenaState_t *state;                  /* ownState, or in shared memory */
+  ArenaState_t ownState;
+  struct Arena_s *next;                 /* node's next arena, once this one is full */
+} Arena_t;
+
+Arena_t arenas[MAX_ARENAS];
+int numNodes = 0;                       /* number of arenas in use */
+int numaSimulated = 0;                  /* true: topology set by MYALLOC_NUMA_NODES */
+const char *heapFile = 0;               /* MYALLOC_HEAP_FILE: where arena 0 lives */
+pthread_once_t arenasOnce = PTHREAD_ONCE_INIT;
+
+/* nonzero while the thread holds an allocator lock or is updating its
+   thread cache: a signal handler (or hook) allocating then must not
+   wait for that lock, see "emergency pool" */
+__thread int allocatorDepth = 0;
+
+static inline void enterAllocator() {
+  allocatorDepth++;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST); /* before what it guards, for handlers */
+}
+
+static inline void leaveAllocator() {
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  allocatorDepth--;
+}
+
+void recoverArena(Arena_t *a);          /* see "shared arenas" */
+
+static inline void unlockArena(Arena_t *a) {
+  pthread_mutex_unlock(&a->state->lock);
+  leaveAllocator();
+}
+
+/* false (and a left unlocked) if a is a shared arena that a dead
+   process left broken */
+static inline int lockArena(Arena_t *a) {
+  enterAllocator();
+  if (__builtin_expect(pthread_mutex_lock(&a->state->lock) == EOWNERDEAD, 0))
+    recoverArena(a);            /* another process died holding it */
+  if (__builtin_expect(a->state->broken, 0)) {
+    unlockArena(a);
+    return 0;
+  }
+  return 1;
+}
+
+/* events: the allocator's slow paths report to the hook set with
+   setAllocHook() (see myAllocator.h), and mark the calling thread so
+   malloc.c can attribute an operation's latency to them */
+
+AllocHook_t allocHook = 0;
+__thread unsigned int threadEvents = 0; /* bit per event since takeAllocEvents() */
+
+AllocHook_t setAllocHook(AllocHook_t hook) { /* returns the previous hook */
+  return __sync_lock_test_and_set(&allocHook, hook);
+}
+
+unsigned int takeAllocEvents() {
+  unsigned int events = threadEvents;
+  threadEvents = 0;
+  return events;
+}
+
+static inline void allocEvent(int event, Arena_t *a, size_t size, size_t extra) {
+  AllocHook_t hook = allocHook;
+  threadEvents |= 1 << event;
+  if (__builtin_expect(hook != 0, 0))
+    hook(event, a->node, size, extra);
+}
+
+int countOnlineNodes() {        /* highest node in sysfs' online list, plus 1 */
+  char buf[128];
+  int fd = open("/sys/devices/system/node/online", O_RDONLY);
+  int i, n, num = 0, last = 0;
+  if (fd < 0)                   /* kernel without NUMA: one node */
+    return 1;
+  n = read(fd, buf, sizeof(buf));
+  close(fd);
+  for (i = 0; i < n; i++) {     /* list looks like "0-1,3" */
+    if (buf[i] >= '0' && buf[i] <= '9')
+      num = num * 10 + (buf[i] - '0');
+    else {
+      last = num;
+      num = 0;
+    }
+  }
+  if (n > 0 && buf[n - 1] >= '0' && buf[n - 1] <= '9')
+    last = num;
+  return last + 1;
+}
+
+void bindToNode(void *addr, size_t len, int node) { /* prefer node's memory for addr */
+  unsigned long mask[MAX_ARENAS / (8 * sizeof(unsigned long)) + 1] = { 0 };
+  if (numaSimulated || numNodes < 2)
+    return;
+  mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+  syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, MAX_ARENAS + 1, 0);
+}
+
+/* chunks: reserved, committed & cached address ranges */
+
+size_t numSyscalls = 0;                 /* mmap & friends issued so far */
+int prefaultCommits = 1;                /* true: fault pages in when committing */
+
+size_t allocatorSyscalls() {
+  return numSyscalls;
+}
+
+void *mapNodeMemory(size_t len, int node) { /* node-local pages, 0 on failure */
+  void *m = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  __sync_fetch_and_add(&numSyscalls, 1);
+  if (m == MAP_FAILED)
+    return (void *)0;
+  bindToNode(m, len, node);
+  return m;
+}
+
+void *reserveChunk(size_t len) { /* address space only, 0 on failure */
+  void *m = mmap(0, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  __sync_fetch_and_add(&numSyscalls, 1);
+  return m == MAP_FAILED ? (void *)0 : m;
+}
+
+int commitChunk(void *addr, size_t len) { /* make reserved pages usable */
+  __sync_fetch_and_add(&numSyscalls, 1);
+  if (mprotect(addr, len, PROT_READ | PROT_WRITE) != 0)
+    return 0;
+#ifdef MADV_POPULATE_WRITE
+  if (prefaultCommits) {        /* take the page faults now, all at once */
+    madvise(addr, len, MADV_POPULATE_WRITE);
+    __sync_fetch_and_add(&numSyscalls, 1);
+  }
+#endif
+  return 1;
+}
+
+void decommitChunk(void *addr, size_t len) { /* drop pages, keep the reservation */
+  madvise(addr, len, MADV_DONTNEED); /* not mmap() over it: that loses bindToNode() */
+  mprotect(addr, len, PROT_NONE);
+  __sync_fetch_and_add(&numSyscalls, 2);
+}
+
+#define CHUNK_CACHE_SLOTS 16
+const size_t CHUNK_CACHE_MAX = 0x4000000;      /* 64M */
+
+typedef struct CachedChunk_s {
+  void *addr;
+  size_t len;
+  int node;
+} CachedChunk_t;
+
+CachedChunk_t chunkCache[CHUNK_CACHE_SLOTS];
+int numCachedChunks = 0;
+size_t cachedBytes = 0;
+pthread_mutex_t chunkCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+int cacheChunk(void *addr, size_t len, int node) { /* keep a released mapping, false if full */
+  int cached = 0;
+  enterAllocator();
+  pthread_mutex_lock(&chunkCacheLock);
+  if (numCachedChunks < CHUNK_CACHE_SLOTS && cachedBytes + len <= CHUNK_CACHE_MAX) {
+    chunkCache[numCachedChunks].addr = addr;
+    chunkCache[numCachedChunks].len = len;
+    chunkCache[numCachedChunks].node = node;
+    numCachedChunks++;
+    cachedBytes += len;
+    cached = 1;
+  }
+  pthread_mutex_unlock(&chunkCacheLock);
+  leaveAllocator();
+  return cached;
+}
+
+/* smallest cached mapping on node holding len (but not twice that),
+   0 if none; *chunkLen is set to its length */
+void *takeCachedChunk(size_t len, int node, size_t *chunkLen) {
+  int i, best = -1;
+  void *m = (void *)0;
+  enterAllocator();
+  pthread_mutex_lock(&chunkCacheLock);
+  for (i = 0; i < numCachedChunks; i++)
+    if (chunkCache[i].node == node && chunkCache[i].len >= len
+	&& chunkCache[i].len / 2 < len
+	&& (best < 0 || chunkCache[i].len < chunkCache[best].len))
+      best = i;
+  if (best >= 0) {
+    m = chunkCache[best].addr;
+    *chunkLen = chunkCache[best].len;
+    cachedBytes -= *chunkLen;
+    chunkCache[best] = chunkCache[--numCachedChunks];
+  }
+  pthread_mutex_unlock(&chunkCacheLock);
+  leaveAllocator();
+  return m;
+}
+
+/* emergency pool
+
+   A signal handler may interrupt its thread inside malloc or free,
+   holding an arena's lock or halfway through a thread cache update
+   (allocatorDepth says so), and a hook runs with an arena locked.  A
+   malloc there can't wait for the lock, so it gets a block of a small
+   pool set aside at startup instead, as does a malloc that finds no
+   memory anywhere else, so crash handlers & OOM logging still get
+   memory.  The latter only get half of each size's blocks, so running
+   out of memory can't use up the blocks handlers need.  Pool blocks
+   are taken & returned with atomic operations on a bitmap per block
+   size only, which makes them async-signal-safe.
+   Arena blocks freed there are pushed on a lock-free list and really
+   freed by the next free outside the allocator. */
+
+#define EMERGENCY_CLASSES 4             /* block sizes: 256, 1K, 4K & 16K */
+#define EMERGENCY_SLOTS 8               /* blocks of each size */
+#define EMERGENCY_OOM_SLOTS 4           /* of those, for mallocs out of memory */
+#define EMERGENCY_SMALLEST 256
+
+static inline size_t emergencyBlockSize(int c) {
+  return EMERGENCY_SMALLEST << (2 * c);
 }
 
-BlockPrefix_t *getNextPrefix(BlockPrefix_t *p) { /* return addr of next block (prefix), or 0 if last */
+char emergencyPool[EMERGENCY_SLOTS * EMERGENCY_SMALLEST * 85] /* 1+4+16+64 smallest */
+  __attribute__((aligned(64)));
+unsigned int emergencyUsed[EMERGENCY_CLASSES]; /* bit per block taken */
+void *deferredFrees = 0;                /* regions freed in a handler, linked through 1st word */
+
+static inline void *emergencyClass(int c) { /* first block of size class c */
+  return emergencyPool + EMERGENCY_SLOTS * EMERGENCY_SMALLEST * (((1 << (2 * c)) - 1) / 3);
+}
+
+/* a block of one of the first slots blocks of its size; async-signal-safe,
+   0 if those are taken */
+void *emergencyAllocRegion(size_t s, int slots) {
+  int c, slot;
+  unsigned int usable = (1U << slots) - 1;
+  for (c = 0; c < EMERGENCY_CLASSES; c++) {
+    size_t len = emergencyBlockSize(c);
+    unsigned int used;
+    if (s > len - prefixSize - suffixSize) /* (adding to s could wrap) */
+      continue;
+    while (((used = emergencyUsed[c]) & usable) != usable) {
+      slot = __builtin_ctz(~used);
+      if (__sync_bool_compare_and_swap(&emergencyUsed[c], used, used | 1U << slot)) {
+	BlockPrefix_t *p = makeFreeBlock(emergencyClass(c) + slot * len, len);
+	p->allocated = BLOCK_EMERGENCY;
+	p->node = 0;
+	return prefixToRegion(p);
+      }
+    }
+  }
+  return (void *)0;
+}
+
+void emergencyFree(BlockPrefix_t *p) { /* async-signal-safe */
+  int c = EMERGENCY_CLASSES - 1;
+  while ((void *)p < emergencyClass(c))
+    c--;
+  __sync_fetch_and_and(&emergencyUsed[c],
+		       ~(1U << (((void *)p - emergencyClass(c)) / emergencyBlockSize(c))));
+}
+
+void deferFree(void *r) {       /* async-signal-safe */
+  void *head;
+  do
+    *(void **)r = head = deferredFrees;
+  while (!__sync_bool_compare_and_swap(&deferredFrees, head, r));
+}
+
+/* free index
+
+   Every free block in an arena has an entry in two parallel arrays:
+   freeSizes[] holds its usable space and freeOffsets[] where it is.
+   A block's prefix records its entry (freeIndex), so entries are
+   added, resized & removed in O(1) (removal moves the last entry into
+   the hole).  Searches scan freeSizes[] a vector of sizes at a time
+   rather than chasing block to block through the arena.  A free adds
+   at most one entry and takes a block out of use, so while the index
+   has room for numFree + numUsed entries frees can't run out of it;
+   allocations commit that room first (indexRoom()) and fail if they
+   can't, so no free block is ever left out of the index. */
+
+typedef int SizeVector_t __attribute__((vector_size(16)));
+#define SIZES_PER_VECTOR (sizeof(SizeVector_t) / sizeof(int))
+
+/* enough entries for an arena of nothing but minimal blocks */
+#define MAX_FREE_ENTRIES (ARENA_RESERVE / (prefixSize + suffixSize + 8))
+#define FREE_INDEX_STEP 0x4000                  /* entries committed at a time */
+
+int reserveFreeIndex(Arena_t *a) {
+  a->freeSizes = reserveChunk(MAX_FREE_ENTRIES * sizeof(int));
+  a->freeOffsets = reserveChunk(MAX_FREE_ENTRIES * sizeof(int));
+  return a->freeSizes && a->freeOffsets;
+}
+
+int growFreeIndex(Arena_t *a) { /* commit room for FREE_INDEX_STEP more entries */
+  size_t len = FREE_INDEX_STEP * sizeof(int);
+  if (a->shared || a->state->freeCommitted + FREE_INDEX_STEP > MAX_FREE_ENTRIES
+      || !commitChunk(a->freeSizes + a->state->freeCommitted, len)
+      || !commitChunk(a->freeOffsets + a->state->freeCommitted, len))
+    return 0;
+  a->state->freeCommitted += FREE_INDEX_STEP;
+  return 1;
+}
+
+static inline BlockPrefix_t *freeIndexBlock(Arena_t *a, size_t i) { /* block of entry i */
+  return (void *)a->arenaBegin + a->freeOffsets[i];
+}
+
+/* room for more entries than the blocks there are, false if the
+   index can't grow that far */
+static inline int indexRoom(Arena_t *a, size_t more) {
+  while (a->state->numFree + a->state->numUsed + more > a->state->freeCommitted)
+    if (!growFreeIndex(a))
+      return 0;
+  return 1;
+}
+
+static inline void indexAdd(Arena_t *a, BlockPrefix_t *p) { /* p just became free */
+  p->freeIndex = a->state->numFree++;
+  a->freeSizes[p->freeIndex] = computeUsableSpace(p);
+  a->freeOffsets[p->freeIndex] = (void *)p - (void *)a->arenaBegin;
+}
+
+static inline void indexResize(Arena_t *a, BlockPrefix_t *p) { /* free p changed size */
+  a->freeSizes[p->freeIndex] = computeUsableSpace(p);
+}
+
+static inline void indexRemove(Arena_t *a, BlockPrefix_t *p) { /* p is no longer free */
+  size_t last = --a->state->numFree;
+  if (p->freeIndex != last) {   /* move the last entry into p's */
+    a->freeSizes[p->freeIndex] = a->freeSizes[last];
+    a->freeOffsets[p->freeIndex] = a->freeOffsets[last];
+    freeIndexBlock(a, p->freeIndex)->freeIndex = p->freeIndex;
+  }
+}
+
+static inline int minLane(SizeVector_t v) {
+  int m = v[0];
+  int i;
+  for (i = 1; i < SIZES_PER_VECTOR; i++)
+    if (v[i] < m)
+      m = v[i];
+  return m;
+}
+
+static inline SizeVector_t minVector(SizeVector_t x, SizeVector_t y) {
+  SizeVector_t smaller = x < y;
+  return (x & smaller) | (y & ~smaller);
+}
+
+/* offsets (from on) of the entries matching need, INT_MAX for the rest */
+static inline SizeVector_t matchingOffsets(Arena_t *a, size_t i, int need, int exact, int from) {
+  SizeVector_t sizes = *(SizeVector_t *)(a->freeSizes + i);
+  SizeVector_t offsets = *(SizeVector_t *)(a->freeOffsets + i);
+  SizeVector_t match = (exact ? sizes == need : sizes >= need) & (offsets >= from);
+  return (offsets & match) | (INT_MAX & ~match);
+}
+
+/* sizes >= need, INT_MAX for the rest */
+static inline SizeVector_t fittingSizes(Arena_t *a, size_t i, int need) {
+  SizeVector_t sizes = *(SizeVector_t *)(a->freeSizes + i);
+  SizeVector_t fits = sizes >= need;
+  return (sizes & fits) | (INT_MAX & ~fits);
+}
+
+#define VECTORS_PER_STEP 4      /* a cache line of each array per step */
+#define SIZES_PER_STEP (VECTORS_PER_STEP * SIZES_PER_VECTOR)
+#define PREFETCH_AHEAD (8 * SIZES_PER_STEP)
+
+/* lowest offset, from on, of an entry with size >= need (and == need
+   if exact), INT_MAX if none: SIZES_PER_VECTOR entries per step,
+   without branches.  Sizes & offsets are below ARENA_RESERVE, so
+   comparing them as ints is safe; so is need, as arenaAllocRegion()
+   turns away requests bigger than the arena could ever be. */
+int scanFreeIndex(Arena_t *a, int need, int exact, int from) {
+  SizeVector_t minOffsets = (SizeVector_t){} + INT_MAX;
+  int best = INT_MAX;
+  size_t i, n = a->state->numFree;
+  for (i = 0; i + SIZES_PER_STEP <= n; i += SIZES_PER_STEP) {
+    __builtin_prefetch(a->freeSizes + i + PREFETCH_AHEAD);
+    __builtin_prefetch(a->freeOffsets + i + PREFETCH_AHEAD);
+    minOffsets = minVector(minOffsets,
+			   minVector(minVector(matchingOffsets(a, i, need, exact, from),
+					       matchingOffsets(a, i + SIZES_PER_VECTOR, need, exact, from)),
+				     minVector(matchingOffsets(a, i + 2 * SIZES_PER_VECTOR, need, exact, from),
+					       matchingOffsets(a, i + 3 * SIZES_PER_VECTOR, need, exact, from))));
+  }
+  for (; i < n; i++)            /* leftover entries */
+    if ((exact ? a->freeSizes[i] == need : a->freeSizes[i] >= need)
+	&& a->freeOffsets[i] >= from && a->freeOffsets[i] < best)
+      best = a->freeOffsets[i];
+  return minLane(minOffsets) < best ? minLane(minOffsets) : best;
+}
+
+/* smallest size >= need in the free index, INT_MAX if none */
+int smallestFit(Arena_t *a, int need) {
+  SizeVector_t minSizes = (SizeVector_t){} + INT_MAX;
+  int best = INT_MAX;
+  size_t i, n = a->state->numFree;
+  for (i = 0; i + SIZES_PER_STEP <= n; i += SIZES_PER_STEP) {
+    __builtin_prefetch(a->freeSizes + i + PREFETCH_AHEAD);
+    minSizes = minVector(minSizes,
+			 minVector(minVector(fittingSizes(a, i, need),
+					     fittingSizes(a, i + SIZES_PER_VECTOR, need)),
+				   minVector(fittingSizes(a, i + 2 * SIZES_PER_VECTOR, need),
+					     fittingSizes(a, i + 3 * SIZES_PER_VECTOR, need))));
+  }
+  for (; i < n; i++)
+    if (a->freeSizes[i] >= need && a->freeSizes[i] < best)
+      best = a->freeSizes[i];
+  return minLane(minSizes) < best ? minLane(minSizes) : best;
+}
+
+/* heap files
+
+   With MYALLOC_HEAP_FILE=path in the environment there is a single
+   arena, and it lives in that file, mapped MAP_SHARED behind a
+   HeapHeader_t page.  Whatever is allocated there is still there for
+   the next process to open the file.  Block metadata holds offsets
+   only, so the heap is valid wherever it is mapped; it is mapped back
+   at its old address when that is free, which keeps pointers stored
+   in regions valid too.  When it isn't, heapMoved() says how far the
+   heap moved, so the program can fix them.  setHeapRoot() records the region a program
+   finds everything else from.  A heap file is open in one process at
+   a time (flock()).  Large requests stay in the arena rather than
+   getting mappings of their own, so a heap holds ARENA_RESERVE at
+   most.  A reopened heap's blocks are checked (badBlock()) before
+   anything trusts them; a heap that fails is left alone. */
+
+#define HEAP_MAGIC "myheap1"
+
+ptrdiff_t heapDisplacement = 0;         /* where the heap is, less where it was */
+
+typedef struct HeapHeader_s {
+  char magic[8];
+  size_t length;                        /* bytes of blocks after the header */
+  size_t root;                          /* offset of the root region, 0 if none */
+  void *base;                           /* where the header was last mapped */
+} HeapHeader_t;
+
+size_t heapHeaderLength() {             /* blocks start a page in */
+  return pageAlign(sizeof(HeapHeader_t));
+}
+
+int mapHeapFile(Arena_t *a, void *addr, size_t len) { /* map more of a's file at addr */
+  off_t offset = addr - (void *)a->heap;
+  __sync_fetch_and_add(&numSyscalls, 2);
+  return ftruncate(a->heapFd, offset + len) == 0
+    && mmap(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, a->heapFd, offset) == addr;
+}
+
+int commitArena(Arena_t *a, void *addr, size_t len) { /* make addr..addr+len usable */
+  if (a->heap == 0)
+    return commitChunk(addr, len);
+  if (!mapHeapFile(a, addr, len))
+    return 0;
+  a->heap->length = addr + len - (void *)a->arenaBegin;
+  return 1;
+}
+
+void decommitArena(Arena_t *a, void *addr, size_t len) { /* give back addr..addr+len */
+  decommitChunk(addr, len);
+  if (a->heap) {                /* the file shrinks as well */
+    a->heap->length = addr - (void *)a->arenaBegin;
+    ftruncate(a->heapFd, addr - (void *)a->heap);
+    __sync_fetch_and_add(&numSyscalls, 1);
+  }
+}
+
+/* first of a's blocks that doesn't add up (0 if they all do): each
+   must lie within the arena, 8-byte aligned, free, allocated or
+   cached.  A heap file or shared arena is all a process that died
+   mid-change leaves behind, so its blocks are checked before use. */
+BlockPrefix_t *badBlock(Arena_t *a) {
+  BlockPrefix_t *p;
+  for (p = a->arenaBegin; (void *)p < a->arenaEnd; p = computeNextPrefixAddr(p)) {
+    size_t left = a->arenaEnd - (void *)p;
+    if (left < prefixSize + suffixSize || p->suffixOffset < prefixSize
+	|| p->suffixOffset % 8 != 0 || p->suffixOffset > left - suffixSize
+	|| (p->allocated != BLOCK_FREE && p->allocated != BLOCK_ALLOCATED
+	    && p->allocated != BLOCK_CACHED))
+      return p;
+  }
+  return (BlockPrefix_t *)0;
+}
+
+/* index the free blocks of a reopened heap (or a recovered shared
+   arena) checked by badBlock(), false if the index can't hold them */
+int rebuildFreeIndex(Arena_t *a) {
+  BlockPrefix_t *p, *prevFree = 0;
+  a->state->numFree = a->state->numUsed = 0;
+  for (p = a->arenaBegin; (void *)p < a->arenaEnd; p = computeNextPrefixAddr(p)) {
+    blockSuffix(p)->prefixOffset = p->suffixOffset; /* may not have been written */
+    if (p->allocated == BLOCK_CACHED) /* its thread cache died with its process */
+      p->allocated = BLOCK_FREE;
+    if (!indexRoom(a, 1))
+      return 0;
+    if (p->allocated) {
+      a->state->numUsed++;
+      prevFree = 0;
+    } else if (prevFree) {      /* coalesce with free predecessor */
+      makeFreeBlock(prevFree, (void *)computeNextPrefixAddr(p) - (void *)prevFree);
+      indexResize(a, prevFree);
+      p = prevFree;
+    } else {
+      indexAdd(a, p);
+      prevFree = p;
+    }
+  }
+  return 1;
+}
+
+int openHeapFile(Arena_t *a, const char *path) { /* put a in path's heap, false on failure */
+  size_t headerLen = heapHeaderLength(), length = DEFAULT_BRKSIZE;
+  HeapHeader_t old;
+  struct stat st;
+  BlockPrefix_t *bad;
+  void *m;
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return 0;
+  memset(&old, 0, sizeof(old));
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0)
+    goto fail;
+  if (st.st_size > 0) {         /* existing heap: never clobber anything else */
+    if (st.st_size < headerLen || pread(fd, &old, sizeof(old), 0) != sizeof(old)
+	|| memcmp(old.magic, HEAP_MAGIC, sizeof(old.magic)) != 0
+	|| headerLen + old.length > st.st_size || old.length > ARENA_RESERVE - headerLen)
+      goto fail;
+    length = old.length;
+  }
+  m = mmap(old.base, ARENA_RESERVE, PROT_NONE, /* old address if still free */
+	   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  __sync_fetch_and_add(&numSyscalls, 1);
+  if (m == MAP_FAILED)
+    goto fail;
+  a->heap = m;
+  a->heapFd = fd;
+  if (!mapHeapFile(a, m, headerLen + length)) {
+    munmap(m, ARENA_RESERVE);
+    a->heap = 0;
+    goto fail;
+  }
+  a->reserved = ARENA_RESERVE - headerLen;
+  a->arenaBegin = m + headerLen;
+  a->arenaEnd = m + headerLen + length;
+  if (old.length == 0) {        /* new heap */
+    memcpy(a->heap->magic, HEAP_MAGIC, sizeof(a->heap->magic));
+    a->heap->length = length;
+    a->heap->root = 0;
+    makeFreeBlock(a->arenaBegin, length);
+  }
+  bad = badBlock(a);
+  if (bad && bad != a->arenaBegin && bad->suffixOffset == 0) { /* grown, not yet written */
+    a->arenaEnd = bad;
+    a->heap->length = (void *)bad - (void *)a->arenaBegin;
+    bad = badBlock(a);
+  }
+  if (bad == 0 && rebuildFreeIndex(a)) {
+    if (old.base)
+      heapDisplacement = m - old.base;
+    a->heap->base = m;
+    return 1;
+  }
+  munmap(m, ARENA_RESERVE);     /* corrupt, or no room to index it: fall back to memory */
+  a->heap = 0;
+  a->arenaBegin = 0;
+  a->arenaEnd = 0;
+  a->state->numFree = a->state->numUsed = 0;
+ fail:
+  close(fd);
+  return 0;
+}
+
+/* shared arenas
+
+   shareArena() puts an arena in a shm_open() or memfd_create()
+   segment; every process that shares the segment allocates from it
+   with sharedAllocRegion() and frees to it with freeRegion(), so a
+   region allocated by one process can be freed by another.  The
+   arena's lock (process-shared & robust) and free index are in the
+   segment with its blocks.  Each process may map the segment at a
+   different address, so a region is handed to another process as its
+   offset (sharedOffset(), sharedRegion()).  Shared regions never go
+   to thread caches, and a shared arena doesn't grow: the first
+   process to share a segment decides its size (ARENA_RESERVE at
+   most, like any arena). */
+
+#define SHARED_MAGIC "myshar3"
+
+typedef struct SharedHeader_s {
+  HeapHeader_t heap;                    /* magic is SHARED_MAGIC */
+  ArenaState_t state;
+} SharedHeader_t;
+
+Arena_t sharedArena;                    /* this process's view of its shared arena */
+
+static inline int inSharedArena(BlockPrefix_t *p) {
+  return (void *)p >= (void *)sharedArena.arenaBegin && (void *)p < sharedArena.arenaEnd;
+}
+
+void formatSharedArena(SharedHeader_t *h, size_t size) { /* first process sets it up */
+  pthread_mutexattr_t attr;
+  memcpy(h->heap.magic, SHARED_MAGIC, sizeof(h->heap.magic));
+  h->heap.length = size;
+  h->heap.root = 0;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&h->state.lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  h->state.numFree = h->state.numUsed = 0;
+  memset(h->state.cursors, 0, sizeof(h->state.cursors));
+  h->state.cursorsUsed = 0;
+  h->state.broken = 0;
+  h->state.freeCommitted = size / (prefixSize + suffixSize + 8); /* room for every block */
+}
+
+/* a process died holding a's lock, maybe halfway through a split or
+   a coalesce: check that its blocks still add up and rebuild the free
+   index from them, as for a reopened heap file.  Blocks that don't add
+   up can't be trusted, so then the arena is marked broken and every
+   process's allocations from it fail. */
+void recoverArena(Arena_t *a) {
+  memset(a->state->cursors, 0, sizeof(a->state->cursors)); /* blocks may merge */
+  if (badBlock(a) || !rebuildFreeIndex(a))
+    a->state->broken = 1;
+  pthread_mutex_consistent(&a->state->lock);
+}
+
+/* allocate from fd's segment too, sizing it for a size byte arena if
+   it is empty; false on failure */
+int shareArena(int fd, size_t size) {
+  Arena_t *a = &sharedArena;
+  size_t headerLen = pageAlign(sizeof(SharedHeader_t)), indexLen;
+  SharedHeader_t *h = 0;
+  struct stat st;
+  int first;
+  if (a->heap || flock(fd, LOCK_EX) != 0) /* one at a time sets a segment up */
+    return 0;
+  if (fstat(fd, &st) != 0)
+    goto fail;
+  first = st.st_size == 0;
+  if (first) {
+    if (size == 0 || size > ARENA_RESERVE) /* offsets in the index are ints */
+      goto fail;
+    size = pageAlign(size);
+    indexLen = pageAlign(size / (prefixSize + suffixSize + 8) * sizeof(int));
+    st.st_size = headerLen + 2 * indexLen + size;
+    if (ftruncate(fd, st.st_size) != 0)
+      goto fail;
+  }
+  h = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  __sync_fetch_and_add(&numSyscalls, 2);
+  if (h == MAP_FAILED) {
+    h = 0;
+    goto fail;
+  }
+  if (first)
+    formatSharedArena(h, size);
+  else if (st.st_size < headerLen
+	   || memcmp(h->heap.magic, SHARED_MAGIC, sizeof(h->heap.magic)) != 0)
+    goto fail;
+  indexLen = pageAlign(h->state.freeCommitted * sizeof(int));
+  if (h->heap.length > ARENA_RESERVE || headerLen + 2 * indexLen + h->heap.length > st.st_size)
+    goto fail;
+  a->freeSizes = (void *)h + headerLen;
+  a->freeOffsets = (void *)h + headerLen + indexLen;
+  a->arenaBegin = (void *)h + headerLen + 2 * indexLen;
+  a->reserved = h->heap.length;
+  a->state = &h->state;
+  a->heapFd = fd;
+  a->shared = 1;
+  if (first) {
+    makeFreeBlock(a->arenaBegin, h->heap.length);
+    indexAdd(a, a->arenaBegin);
+  }
+  a->heap = &h->heap;
+  a->arenaEnd = (void *)a->arenaBegin + h->heap.length; /* now inSharedArena() */
+  flock(fd, LOCK_UN);
+  return 1;
+ fail:
+  if (h)
+    munmap(h, st.st_size);
+  flock(fd, LOCK_UN);
+  return 0;
+}
+
+void initializeArena(Arena_t *a, int node) {
+  void *m;
+  a->state = &a->ownState;
+  pthread_mutex_init(&a->state->lock, 0);
+  a->node = node;
+  a->commitStep = DEFAULT_BRKSIZE;
+  if (!reserveFreeIndex(a))     /* leave arena empty */
+    return;
+  if (heapFile && a == &arenas[0]) {
+    if (openHeapFile(a, heapFile))
+      return;
+    writeMessage("can't open heap file ");
+    writeMessage(heapFile);
+    writeMessage(", heap won't persist\n");
+  }
+  m = reserveChunk(ARENA_RESERVE);
+  if (m == 0)
+    return;
+  bindToNode(m, ARENA_RESERVE, node); /* applies to pages committed later */
+  if (!commitChunk(m, DEFAULT_BRKSIZE) || !indexRoom(a, 1))
+    return;
+  a->reserved = ARENA_RESERVE;
+  a->arenaBegin = makeFreeBlock(m, DEFAULT_BRKSIZE);
+  a->arenaEnd = m + DEFAULT_BRKSIZE;
+  indexAdd(a, a->arenaBegin);
+}
+
+void prepareFork(), forkedParent(), forkedChild(); /* see "fork" below */
+
+void initializeArenas() {       /* discover the topology, one arena per node */
+  char *simulated = getenv("MYALLOC_NUMA_NODES");
+  int node;
+  if (simulated && atoi(simulated) > 0) {
+    numNodes = atoi(simulated);
+    numaSimulated = 1;
+  } else
+    numNodes = countOnlineNodes();
+  heapFile = getenv("MYALLOC_HEAP_FILE");
+  if (heapFile)                 /* one arena, all of it in the file */
+    numNodes = 1;
+  if (numNodes > MAX_ARENAS)
+    numNodes = MAX_ARENAS;
+  for (node = 0; node < numNodes; node++)
+    initializeArena(&arenas[node], node);
+  memset(emergencyPool, 0, sizeof(emergencyPool)); /* its pages, before memory runs out */
+  pthread_atfork(prepareFork, forkedParent, forkedChild);
+}
+
+int numaNodeCount() {
+  pthread_once(&arenasOnce, initializeArenas);
+  return numNodes;
+}
+
+int currentNode() {             /* node the calling thread is running on */
+  unsigned int cpu = 0, node = 0;
+  if (numaNodeCount() < 2 || getcpu(&cpu, &node) != 0)
+    return 0;
+  if (numaSimulated)
+    node = cpu % numNodes;
+  return node % numNodes;
+}
+
+Arena_t *currentArena() {
+  return &arenas[currentNode()];
+}
+
+static inline BlockPrefix_t *getNextPrefix(Arena_t *a, BlockPrefix_t *p) { /* return addr of next block (prefix), or 0 if last */
   BlockPrefix_t *np = computeNextPrefixAddr(p);
-  if ((void*)np < (void *)arenaEnd)
+  if ((void*)np < (void *)a->arenaEnd)
     return np;
   else
     return (BlockPrefix_t *)0;
 }
 
-BlockPrefix_t *getPrevPrefix(BlockPrefix_t *p) { /* return addr of prev block, or 0 if first */
+static inline BlockPrefix_t *getPrevPrefix(Arena_t *a, BlockPrefix_t *p) { /* return addr of prev block, or 0 if first */
   BlockSuffix_t *ps = computePrevSuffixAddr(p);
-  if ((void *)ps > (void *)arenaBegin)
-    return ps->prefix;
+  if ((void *)ps > (void *)a->arenaBegin)
+    return suffixPrefix(ps);
   else
     return (BlockPrefix_t *)0;
 }
 
-BlockPrefix_t *coalescePrev(BlockPrefix_t *p) { /* coalesce p with prev, return prev if coalesced, otherwise p */
-  BlockPrefix_t *prev = getPrevPrefix(p);
+/* block gone was merged into block into: move next fit's cursors */
+static inline void moveCursors(Arena_t *a, BlockPrefix_t *gone, BlockPrefix_t *into) {
+  int i, offset = (void *)gone - (void *)a->arenaBegin;
+  if (!a->state->cursorsUsed)
+    return;
+  for (i = 0; i < NEXT_FIT_CURSORS; i++)
+    if (a->state->cursors[i] == offset)
+      a->state->cursors[i] = (void *)into - (void *)a->arenaBegin;
+}
+
+BlockPrefix_t *coalescePrev(Arena_t *a, BlockPrefix_t *p) { /* coalesce p with prev, return prev if coalesced, otherwise p */
+  BlockPrefix_t *prev = getPrevPrefix(a, p);
   if (p && prev && (!p->allocated) && (!prev->allocated)) {
+    indexRemove(a, p);          /* p disappears into prev */
+    moveCursors(a, p, prev);
     makeFreeBlock(prev, ((void *)computeNextPrefixAddr(p)) - (void *)prev);
+    indexResize(a, prev);
+    allocEvent(ALLOC_EVENT_COALESCE, a, computeUsableSpace(prev), 0);
     return prev;
   }
   return p;
 }    
 
 
-void coalesce(BlockPrefix_t *p) {   /* coalesce p with prev & next */
+void coalesce(Arena_t *a, BlockPrefix_t *p) {   /* coalesce p with prev & next */
   if (p != (void *)0) {
     BlockPrefix_t *next;
-    p = coalescePrev(p);
-    next = getNextPrefix(p);
+    p = coalescePrev(a, p);
+    next = getNextPrefix(a, p);
     if (next) 
-      coalescePrev(next);
+      coalescePrev(a, next);
   }
 }
 
-int growingDisabled = 1;            /* true: don't grow arena! (needed for cygwin) */
+int growingDisabled = 0;            /* true: don't grow arena! */
 
-BlockPrefix_t *growArena(size_t s) { /* this won't work under cygwin since runtime uses brk()!! */
-  void *n;
+BlockPrefix_t *growArena(Arena_t *a, size_t s) {
+  void *n = a->arenaEnd;
+  size_t need = pageAlign(s + prefixSize + suffixSize);
+  size_t left = ((void *)a->arenaBegin + a->reserved) - n;
   BlockPrefix_t *p;
-  printf("trying to call grow arena \n");
-  if (growingDisabled){
-    printf("growing is diabled so will return [%s]  [%llx] \n", p, (long long)p);
+  if (growingDisabled)
     return (BlockPrefix_t *)0;
-  }
-  s += (prefixSize + suffixSize);
-  if (s < DEFAULT_BRKSIZE)
-    s = DEFAULT_BRKSIZE;
-  n = sbrk(s);
-  if ((n == 0) || (n != arenaEnd))  /* fail if brk moved or failed! */
+  s = need < a->commitStep ? a->commitStep : need;
+  if (s > left)                     /* reservation nearly used up */
+    s = left;
+  if (s < need || !commitArena(a, n, s))
     return 0;
-  arenaEnd = n + s;                 /* new end */
+  if (a->commitStep < MAX_COMMIT_STEP) /* growing again soon is likely */
+    a->commitStep *= 2;
+  a->arenaEnd = n + s;              /* new end */
+  allocEvent(ALLOC_EVENT_GROW, a, s, a->arenaEnd - (void *)a->arenaBegin);
   p = makeFreeBlock(n, s);          /* create new block */
-  p = coalescePrev(p);              /* coalesce with old arena end  */
+  indexAdd(a, p);
+  p = coalescePrev(a, p);           /* coalesce with old arena end  */
   return p;
 }
 
+/* a's reservation can't take a block of s bytes: it is used up */
+static inline int reserveUsedUp(Arena_t *a, size_t s) {
+  return (void *)a->arenaBegin + a->reserved - a->arenaEnd < pageAlign(s + prefixSize + suffixSize);
+}
 
-int pcheck(void *p) {               /* check that pointer is within arena */
-  return (p >= (void *)arenaBegin && p < (void *)arenaEnd);
+/* the node's arena after a (locked), chained now if a is the last:
+   0 if there's no memory for one */
+Arena_t *chainArena(Arena_t *a) {
+  Arena_t *n = a->next;
+  if (n)
+    return n;
+  n = mmap(0, sizeof(Arena_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  __sync_fetch_and_add(&numSyscalls, 1);
+  if (n == MAP_FAILED)
+    return (Arena_t *)0;
+  initializeArena(n, a->node);  /* (zeroed, as arenas[] are) */
+  if (n->arenaBegin == 0) {     /* leaves its free index reserved */
+    munmap(n, sizeof(Arena_t));
+    return (Arena_t *)0;
+  }
+  __atomic_store_n(&a->next, n, __ATOMIC_RELEASE); /* for arenaOf() */
+  return n;
 }
 
+void trimArena(Arena_t *a) {        /* decommit a large free tail */
+  BlockSuffix_t *lastSuffix = a->arenaEnd - suffixSize;
+  BlockPrefix_t *last = suffixPrefix(lastSuffix);
+  void *newEnd = (void *)pageAlign((size_t)last + prefixSize + suffixSize + DEFAULT_BRKSIZE);
+  if (last->allocated || a->shared || newEnd + TRIM_THRESHOLD > a->arenaEnd)
+    return;
+  decommitArena(a, newEnd, a->arenaEnd - newEnd);
+  allocEvent(ALLOC_EVENT_TRIM, a, a->arenaEnd - newEnd, newEnd - (void *)a->arenaBegin);
+  a->arenaEnd = newEnd;
+  makeFreeBlock(last, newEnd - (void *)last);
+  indexResize(a, last);
+  a->commitStep = DEFAULT_BRKSIZE;  /* shrinking: start growth over */
+}
 
-void arenaCheck() {                 /* consistency check */
-  BlockPrefix_t *p = arenaBegin;
-  size_t amtFree = 0, amtAllocated = 0;
-  int numBlocks = 0;
+
+int pcheck(Arena_t *a, void *p) {   /* check that pointer is within arena */
+  return (p >= (void *)a->arenaBegin && p < (void *)a->arenaEnd);
+}
+
+Arena_t *arenaOf(BlockPrefix_t *p) { /* arena holding p, 0 if none */
+  int node;
+  Arena_t *a;
+  for (node = 0; node < numNodes; node++) /* reservations never move */
+    for (a = &arenas[node]; a; a = __atomic_load_n(&a->next, __ATOMIC_ACQUIRE))
+      if ((void *)p >= (void *)a->arenaBegin && (void *)p < (void *)a->arenaBegin + a->reserved)
+	return a;
+  if (inSharedArena(p))
+    return &sharedArena;
+  return (Arena_t *)0;
+}
+
+
+/* arenaCheck() & printBlockInfo() take no locks: debugging only */
+
+void checkArena(Arena_t *a) {       /* consistency check */
+  BlockPrefix_t *p = a->arenaBegin;
+  size_t amtFree = 0, amtAllocated = 0, amtWasted = 0, largestFree = 0;
+  int numBlocks = 0, numFree = 0, i;
+  unsigned int cursorsFound = 0;    /* bit per next fit cursor */
 
   while (p != 0) {                  /* walk through arena */
     fprintf(stderr, "  checking from 0x%llx, size=%lld, allocated=%d...\n",
 	    (long long)p,
 	    (long long)computeUsableSpace(p), p->allocated);
-    assert(pcheck(p));              /* p must remain within arena */
-    assert(pcheck(p->suffix));      /* suffix must be within arena */
-    assert(p->suffix->prefix == p); /* suffix should reference prefix */
+    assert(pcheck(a, p));           /* p must remain within arena */
+    assert(pcheck(a, blockSuffix(p))); /* suffix must be within arena */
+    assert(suffixPrefix(blockSuffix(p)) == p); /* suffix should reference prefix */
     if (p->allocated)               /* update allocated & free space */
       amtAllocated += computeUsableSpace(p);
     else
       amtFree += computeUsableSpace(p);
+    if (p->allocated == BLOCK_ALLOCATED) /* lost to size class rounding */
+      amtWasted += p->slack;
+    else if (!p->allocated && computeUsableSpace(p) > largestFree)
+      largestFree = computeUsableSpace(p);
+    if (!p->allocated) {            /* free index must describe p */
+      assert(p->freeIndex < a->state->numFree);
+      assert(freeIndexBlock(a, p->freeIndex) == p);
+      assert(a->freeSizes[p->freeIndex] == computeUsableSpace(p));
+      numFree += 1;
+    }
+    for (i = 0; i < NEXT_FIT_CURSORS; i++) /* cursors must be on block boundaries */
+      if (a->state->cursors[i] == (void *)p - (void *)a->arenaBegin)
+	cursorsFound |= 1 << i;
     numBlocks += 1;
     p = computeNextPrefixAddr(p);
-    if (p == arenaEnd) {
+    if (p == a->arenaEnd) {
       break;
     } else {
-      assert(pcheck(p));
+      assert(pcheck(a, p));
     }
   }//end of while
+  assert(numFree == a->state->numFree);    /* and nothing else */
+  assert(numBlocks - numFree == a->state->numUsed);
+  assert(numBlocks <= a->state->freeCommitted); /* every block may become free */
+  assert(cursorsFound == (1 << NEXT_FIT_CURSORS) - 1);
   fprintf(stderr,
-	  " mcheck: numBlocks=%d, amtAllocated=%lldk, amtFree=%lldk, arenaSize=%lldk\n",
+	  " mcheck: numBlocks=%d, amtAllocated=%lldk, amtFree=%lldk, arenaSize=%lldk,"
+	  " amtWasted=%lldk, largestFree=%lldk\n",
 	  numBlocks,
 	  (long long)amtAllocated / 1024LL,
 	  (long long)amtFree/1024LL,
-	  ((long long)arenaEnd - (long long)arenaBegin) / 1024LL);
+	  ((long long)a->arenaEnd - (long long)a->arenaBegin) / 1024LL,
+	  (long long)amtWasted / 1024LL,
+	  (long long)largestFree / 1024LL);
+}
+
+void arenaCheck() {                 /* check every node's arenas & the shared one */
+  int node;
+  Arena_t *a;
+  for (node = 0; node < numaNodeCount(); node++)
+    for (a = &arenas[node]; a; a = a->next)
+      checkArena(a);
+  if (sharedArena.heap)
+    checkArena(&sharedArena);
 }
 
 //this Method prints info for each block
-void printBlockInfo(){
+void printArenaBlockInfo(Arena_t *a){
 
- BlockPrefix_t *p = arenaBegin;
+ BlockPrefix_t *p = a->arenaBegin;
  size_t singleAmtFree, singleAllocated, totalAmtFree, totalAllocated ;
   int numBlocks = 0, blockNumber =0;
   totalAmtFree = 0, totalAllocated = 0;
@@ -223,96 +1214,154 @@ void printBlockInfo(){
 
     blockNumber += 1;
     p = computeNextPrefixAddr(p);
-    if (p == arenaEnd) {
+    if (p == a->arenaEnd) {
       break;
     } else {
-      assert(pcheck(p));
+      assert(pcheck(a, p));
     }
   }//end of while
 }
 
+void printBlockInfo(){
+  int node;
+  Arena_t *a;
+  for (node = 0; node < numaNodeCount(); node++)
+    for (a = &arenas[node]; a; a = a->next)
+      printArenaBlockInfo(a);
+}
 
+/* internal fragmentation (size class rounding) vs external
+   fragmentation (free space split into blocks too small to use) over
+   all arenas; regions in their own mappings aren't counted */
+void fragmentationStats(FragmentationStats_t *st) {
+  int node;
+  Arena_t *a;
+  BlockPrefix_t *p;
+  memset(st, 0, sizeof(*st));
+  for (node = 0; node < numaNodeCount(); node++)
+    for (a = &arenas[node]; a; a = a->next) {
+      lockArena(a);
+      for (p = a->arenaBegin; p; p = getNextPrefix(a, p)) {
+	size_t usable = computeUsableSpace(p);
+	__builtin_prefetch(computeNextPrefixAddr(p));
+	if (p->allocated == BLOCK_ALLOCATED) {
+	  st->allocated += usable;
+	  st->requested += usable - p->slack;
+	} else if (p->allocated == BLOCK_CACHED)
+	  st->cached += usable;
+	else {
+	  st->free += usable;
+	  st->freeBlocks++;
+	  if (usable > st->largestFree)
+	    st->largestFree = usable;
+	}
+      }
+      unlockArena(a);
+    }
+  st->internal = st->allocated - st->requested;
+  st->external = st->free - st->largestFree;
+}
 
-BlockPrefix_t *findFirstFit(size_t s) { /* find first block with usable space > s */
-  BlockPrefix_t *p = arenaBegin;
-  while (p) {
+
+/* Searches first walk the front of the arena, which is cheapest when
+   a fit is near it, and only then scan the free index.  Stepping to
+   the next block costs about as much as scanning 64 entries. */
+
+static inline size_t walkLimit(Arena_t *a) { /* blocks to walk before scanning */
+  return 16 + a->state->numFree / 64;
+}
+
+BlockPrefix_t *findFirstFit(Arena_t *a, size_t s) { /* find first block with usable space > s */
+  BlockPrefix_t *p = a->arenaBegin;
+  int offset, n;
+  for (n = 0; p && n < walkLimit(a); n++, p = getNextPrefix(a, p))
     if (!p->allocated && computeUsableSpace(p) >= s)
       return p;
-    p = getNextPrefix(p);
-  }
-  return growArena(s);
+  if (p == 0)                   /* walked the whole arena */
+    return growArena(a, s);
+  offset = scanFreeIndex(a, s, 0, 0); /* lowest address that fits */
+  if (offset == INT_MAX)
+    return growArena(a, s);
+  __builtin_prefetch((void *)a->arenaBegin + offset, 1); /* about to be split */
+  return (void *)a->arenaBegin + offset;
 }
 
-/* conversion between blocks & regions (offset of prefixSize */
+/* blocks with their own mapping (see MMAP_THRESHOLD) */
 
-BlockPrefix_t *regionToPrefix(void *r) {
-  if (r)
-    return r - prefixSize;
-  else
-    return 0;
+size_t computeMappedLength(BlockPrefix_t *p) { /* length of p's mapping */
+  return ((void *)computeNextPrefixAddr(p)) - (void *)p;
 }
 
-
-void *prefixToRegion(BlockPrefix_t *p) {
-  void * vp = p;
-  if (p)
-    return vp + prefixSize;
-  else
-    return 0;
+size_t mappingLength(size_t s) { /* pages for an s byte region, 0 if s is too big */
+  if (s > SIZE_MAX - (prefixSize + suffixSize + sysconf(_SC_PAGESIZE)))
+    return 0;                   /* would wrap around */
+  return pageAlign(prefixSize + align8(s) + suffixSize);
 }
 
-/* these really are equivalent to malloc & free */
-void *firstFitAllocRegion(size_t s) {
-  
-  size_t asize = align8(s);
-  size_t availSize;
+void *mapAllocRegion(size_t s, int node) { /* allocate a region in a mapping of its own */
+  size_t len = mappingLength(s);
+  void *m;
   BlockPrefix_t *p;
-  if (arenaBegin == 0)         
-    initializeArena();
-  p = findFirstFit(s);          /* find a block */
-  if (p) {                      /* found a block */
-    availSize = computeUsableSpace(p);
-    if (availSize >= (asize + prefixSize + suffixSize + 8)) { /* split block? */
-      void *freeSliverStart = (void *)p + prefixSize + suffixSize + asize;
-      void *freeSliverEnd = computeNextPrefixAddr(p);
-      makeFreeBlock(freeSliverStart, freeSliverEnd - freeSliverStart);//right half
-      makeFreeBlock(p, freeSliverStart - (void *)p); /* piece being allocated left half */
-    }
-    p->allocated = 1;           /* mark as allocated */
-    return prefixToRegion(p);   /* convert to *region */
-  } else {                      /* failed */
-    BlockPrefix_t *tryer = arenaBegin;
-    availSize = computeUsableSpace(tryer);
-    printf("**FAILED** to find and empty continuous size of %d   ONLY HAVE %d\n",s, availSize);
+  if (len == 0)
     return (void *)0;
-  }
-  
+  m = takeCachedChunk(len, node, &len);
+  if (m == 0)
+    m = mapNodeMemory(len, node);
+  if (m == 0)
+    return (void *)0;
+  p = makeFreeBlock(m, len);
+  p->allocated = BLOCK_MAPPED;
+  p->node = node;
+  return prefixToRegion(p);
 }
 
-void freeRegion(void *r) {
-  if (r != 0) {
-    BlockPrefix_t *p = regionToPrefix(r); /* convert to block */
-    p->allocated = 0;           /* mark as free */
-    
-    coalesce(p);
+void *mapResizeRegion(void *r, size_t newSize) { /* mremap r's mapping to fit newSize */
+  BlockPrefix_t *p = regionToPrefix(r);
+  size_t oldLen = computeMappedLength(p);
+  size_t newLen = mappingLength(newSize);
+  void *m;
+  if (newLen == 0)
+    return (void *)0;
+  m = mremap(p, oldLen, newLen, MREMAP_MAYMOVE);
+  __sync_fetch_and_add(&numSyscalls, 1);
+  if (m == MAP_FAILED)
+    return (void *)0;
+  p = makeFreeBlock(m, newLen); /* suffix moved, region contents did not */
+  p->allocated = BLOCK_MAPPED;  /* p->node is unchanged */
+  return prefixToRegion(p);
+}
+
+static inline void *noteRequest(void *r, size_t s) { /* record that r holds s bytes */
+  if (r) {
+    BlockPrefix_t *p = regionToPrefix(r);
+    p->slack = computeUsableSpace(p) - s;
   }
+  return r;
 }
 
+static inline void splitBlock(Arena_t *a, BlockPrefix_t *p, size_t asize) { /* free p's excess beyond asize */
+  if (computeUsableSpace(p) >= (asize + prefixSize + suffixSize + 8)) { /* split block? */
+    void *freeSliverStart = (void *)p + prefixSize + suffixSize + asize;
+    void *freeSliverEnd = computeNextPrefixAddr(p);
+    allocEvent(ALLOC_EVENT_SPLIT, a, computeUsableSpace(p), asize);
+    indexAdd(a, makeFreeBlock(freeSliverStart, freeSliverEnd - freeSliverStart));//right half
+    makeFreeBlock(p, freeSliverStart - (void *)p); /* piece being allocated left half */
+  }
+}
 
 /* create a block, mark it as free */
 BlockPrefix_t *combine(void *left, void *right) { 
   BlockPrefix_t *p = left;
   void *limitAddr = left + (((void *)computeNextPrefixAddr(right)) - (void *)left);
   BlockSuffix_t *s = limitAddr - align8(sizeof(BlockSuffix_t));
-  p->suffix = s;
-  s->prefix = p;
+  p->suffixOffset = s->prefixOffset = (void *)s - left;
   p->allocated = 1;
   return p;
 }
 
 void *resizeRegion(void *r, size_t newSize) {
-  size_t asize = align8(newSize);
-  int oldSize;
+  size_t asize = roundRequest(newSize);
+  size_t oldSize;               /* a mapped region's may be over 2G */
   
   
   if (r != (void *)0)           /* old region existed */
@@ -322,148 +1371,497 @@ void *resizeRegion(void *r, size_t newSize) {
   
   
   if (oldSize >= newSize)       /* old region is big enough */
-    return r;
+    return noteRequest(r, newSize);
+  else if (regionToPrefix(r)->allocated == BLOCK_MAPPED)
+    return noteRequest(mapResizeRegion(r, newSize), newSize);
+  else if (regionToPrefix(r)->allocated == BLOCK_EMERGENCY || allocatorDepth != 0
+	   || arenaOf(regionToPrefix(r)) == 0)
+    return (void *)0;           /* pool & parent's heap blocks, or can't lock: must move */
+  else if (newSize >= MMAP_THRESHOLD && !arenaOf(regionToPrefix(r))->heap)
+    return (void *)0;           /* belongs in a mapping; must move */
   else{
     BlockPrefix_t *current =regionToPrefix(r);
-    BlockPrefix_t *next=getNextPrefix(current);
+    Arena_t *a = arenaOf(current);
+    BlockPrefix_t *next;
+    if (!lockArena(a))
+      return (void *)0;
+    next=getNextPrefix(a, current);
 
     if(next){
-      int combinedSizes = computeUsableSpace(next)+oldSize+16;//add 16 fo
-      if(!next->allocated  &&  combinedSizes >= newSize )
+      size_t combinedSizes = computeUsableSpace(next)+oldSize+16;//add 16 fo
+      if(!next->allocated  &&  combinedSizes >= newSize ) {
+	indexRemove(a, next);
+	moveCursors(a, next, current);
 	current = combine(current, next);//this method combines two spaces together
+      }
     }
     
-    int foundSize = computeUsableSpace(current);
+    size_t foundSize = computeUsableSpace(current);
     
-    if(foundSize >= (asize + prefixSize + suffixSize + 8)) { /* split block? */
-      void *freeSliverStart = (void *)current + prefixSize + suffixSize + asize;
-      void *freeSliverEnd = computeNextPrefixAddr(current);
-      makeFreeBlock(freeSliverStart, freeSliverEnd - freeSliverStart);//right half
-      makeFreeBlock(current, freeSliverStart - (void *)current); /* piece being allocated left half */
-      current->allocated = 1;         // mark as allocated 
-    }
-    else
+    if (foundSize < newSize) {  /* neither combined nor big enough */
+      unlockArena(a);
       return (void *)0;
-    return (void *)(prefixToRegion(current));
+    }
+    splitBlock(a, current, align8(asize));
+    current->allocated = 1;     // mark as allocated 
+    unlockArena(a);
+    return noteRequest(prefixToRegion(current), newSize);
   } 
 }
 
 
-BlockPrefix_t *findBestFit(size_t s) { /* find first block with usable space > s */
-  BlockPrefix_t *p = arenaBegin;
-  BlockPrefix_t *currentBestFit = arenaBegin;
-  size_t currentBestSizeDifference =-1;//stays negative until a valid spot is found
-  while (p) {
-    int iteratedUsableSpace = computeUsableSpace(p);
-    if (!p->allocated && iteratedUsableSpace >= s){
-      size_t justFoundSizeDifference = iteratedUsableSpace - s;
-      if(justFoundSizeDifference == 0)//base case if finds perfect size
-	return p;
-      else{
-	if(currentBestSizeDifference < 0 ){//first valid empty spot gets taken 
-	  currentBestSizeDifference = justFoundSizeDifference;
-	  currentBestFit = p;
-	}
-	else{//already has a spot and checking if is a better fit
-	  if(justFoundSizeDifference < currentBestSizeDifference){
-	    currentBestSizeDifference = justFoundSizeDifference;
-	    currentBestFit = p;
-	  }
-	}
-      }
+BlockPrefix_t *findBestFit(Arena_t *a, size_t s) { /* find first block with usable space > s */
+  BlockPrefix_t *p = a->arenaBegin;
+  int bestSize, offset, n;
+  for (n = 0; p && n < walkLimit(a); n++, p = getNextPrefix(a, p))
+    if (!p->allocated && computeUsableSpace(p) == s) /* can't do better */
+      return p;
+  bestSize = smallestFit(a, s);
+  if (bestSize == INT_MAX)      /* nothing fits */
+    return growArena(a, s);
+  offset = scanFreeIndex(a, bestSize, 1, 0); /* lowest address of that size */
+  __builtin_prefetch((void *)a->arenaBegin + offset, 1);
+  return (void *)a->arenaBegin + offset;
+}
+
+
+/* next fit: each thread searches on from where its last search ended
+   (its cursor), wrapping around at the arena's end.  Threads take
+   the arena's cursors round robin, so mostly each has its own and
+   allocates near what it allocated last.  Cursors hold offsets of
+   block boundaries; moveCursors() keeps them on one when blocks
+   merge.  A search walks a bounded stretch from the cursor, then
+   scans the free index for the lowest fitting offset past the
+   stretch, then from the arena's beginning. */
+
+__thread int cursorSlot = -1;           /* this thread's cursor */
+int cursorsHandedOut = 0;
+
+static inline int *threadCursor(Arena_t *a) {
+  if (__builtin_expect(cursorSlot < 0, 0))
+    cursorSlot = __sync_fetch_and_add(&cursorsHandedOut, 1) % NEXT_FIT_CURSORS;
+  a->state->cursorsUsed = 1;
+  return &a->state->cursors[cursorSlot];
+}
+
+BlockPrefix_t *findNextFit(Arena_t *a, size_t s) { /* find next block with usable space > s */
+  int *cursor = threadCursor(a);
+  BlockPrefix_t *p = (void *)a->arenaBegin + *cursor;
+  int offset, n;
+  for (n = 0; p && n < walkLimit(a); n++, p = getNextPrefix(a, p)) {
+    __builtin_prefetch(computeNextPrefixAddr(p)); /* next header, while checking this one */
+    if (!p->allocated && computeUsableSpace(p) >= s) {
+      *cursor = (void *)p - (void *)a->arenaBegin;
+      return p;
     }
-    p = getNextPrefix(p);
-  }//end of while loop
-  if(currentBestSizeDifference < 0)
-    return growArena(s);
-  else
-    return currentBestFit;
+  }
+  offset = INT_MAX;
+  if (p)                        /* rest of the way to the end */
+    offset = scanFreeIndex(a, s, 0, (void *)p - (void *)a->arenaBegin);
+  if (offset == INT_MAX)        /* wrap around */
+    offset = scanFreeIndex(a, s, 0, 0);
+  if (offset == INT_MAX) {
+    p = growArena(a, s);
+    if (p)
+      *cursor = (void *)p - (void *)a->arenaBegin;
+    return p;
+  }
+  *cursor = offset;
+  return (void *)a->arenaBegin + offset;
 }
 
+/* allocation fast paths
 
-void *bestFitAllocRegion(size_t s){
-  size_t asize = align8(s);
-  size_t availSize;
-  BlockPrefix_t *p;
-  if (arenaBegin == 0)          /* arena uninitialized? */
-    initializeArena();
-  p = findBestFit(s);          /* find a block */
-  if (p) {                      /* found a block */
-    availSize = computeUsableSpace(p);
-    if (availSize >= (asize + prefixSize + suffixSize + 8)) { /* split block? */
-      void *freeSliverStart = (void *)p + prefixSize + suffixSize + asize;
-      void *freeSliverEnd = computeNextPrefixAddr(p);
-      makeFreeBlock(freeSliverStart, freeSliverEnd - freeSliverStart);//right half
-      makeFreeBlock(p, freeSliverStart - (void *)p); /* piece being allocated left half */
+   Freed blocks of small size classes are kept in per-thread bins, one
+   per class, so
+   most small mallocs & frees touch neither an arena nor its lock.
+   A cached block stays in its arena marked BLOCK_CACHED; only blocks
+   from the arena of the freeing thread's node are cached, since they
+   go to that thread's next mallocs.  The fit
+   policy behind allocRegion() (i.e. malloc) is picked when building,
+   e.g. with -DALLOC_POLICY=findBestFit. */
+
+#ifndef ALLOC_POLICY
+#define ALLOC_POLICY findFirstFit
+#endif
+
+#define SMALL_MAX 256                   /* largest cached request */
+#define TCACHE_DEPTH 16                 /* most blocks in a thread's bin */
+
+typedef struct CacheBin_s {
+  void *head;                           /* regions, linked through 1st word */
+  int count;
+} CacheBin_t;
+
+__thread CacheBin_t threadCache[NUM_SIZE_CLASSES]; /* only small ones used */
+__thread int threadCacheRegistered = 0;
+pthread_key_t threadCacheKey;
+pthread_once_t threadCacheOnce = PTHREAD_ONCE_INIT;
+
+void freeArenaBlock(BlockPrefix_t *p) { /* give p back to the arena holding it */
+  Arena_t *a = arenaOf(p);      /* back to its own node's arena */
+  if (!lockArena(a))            /* a broken shared arena */
+    return;
+  p->allocated = 0;             /* mark as free */
+  a->state->numUsed--;
+  indexAdd(a, p);               /* there's room: see indexRoom() */
+  coalesce(a, p);
+  trimArena(a);
+  unlockArena(a);
+}
+
+void flushThreadCache(void *unused) { /* thread exit: empty its bins */
+  int c;
+  for (c = 0; c < NUM_SIZE_CLASSES; c++) {
+    while (threadCache[c].head) {
+      void *r = threadCache[c].head;
+      threadCache[c].head = *(void **)r;
+      freeArenaBlock(regionToPrefix(r));
     }
-    p->allocated = 1;           /* mark as allocated */
-    return prefixToRegion(p);   /* convert to *region */
-  } else {                      /* failed */
-    BlockPrefix_t *tryer = arenaBegin;
-    availSize = computeUsableSpace(tryer);
-    printf("**FAILED** to find and empty continuous size of %d   ONLY HAVE %d\n",s, availSize);
+    threadCache[c].count = 0;
+  }
+}
+
+void createThreadCacheKey() {
+  pthread_key_create(&threadCacheKey, flushThreadCache);
+}
+
+void registerThreadCache() {    /* so flushThreadCache() runs at thread exit */
+  pthread_once(&threadCacheOnce, createThreadCacheKey);
+  pthread_setspecific(threadCacheKey, threadCache);
+  threadCacheRegistered = 1;
+}
+
+static inline void *takeCachedRegion(int c) { /* pop a region from bin c, or 0 */
+  CacheBin_t *bin = &threadCache[c];
+  void *r;
+  if (__builtin_expect(allocatorDepth != 0, 0)) /* bin may be mid-update */
     return (void *)0;
+  enterAllocator();
+  r = bin->head;
+  if (r) {
+    bin->head = *(void **)r;
+    bin->count--;
+    regionToPrefix(r)->allocated = BLOCK_ALLOCATED;
   }
+  leaveAllocator();
+  return r;
 }
 
+static inline int cacheRegion(BlockPrefix_t *p) { /* push p onto its bin, false if it won't go */
+  size_t usable = computeUsableSpace(p);
+  CacheBin_t *bin;
+  void *r;
+  int c;
+  if (usable > SMALL_MAX)
+    return 0;
+  c = sizeClassOf[usable >> 3];
+  if (sizeClassSize[c] > usable) /* bins only hold blocks fitting their class */
+    c--;
+  bin = &threadCache[c];
+  if (bin->count >= TCACHE_DEPTH)
+    return 0;
+  if (numNodes > 1 && arenaOf(p)->node != currentNode())
+    return 0;                   /* the next malloc here wants this node's memory */
+  if (__builtin_expect(!threadCacheRegistered, 0))
+    registerThreadCache();
+  enterAllocator();
+  p->allocated = BLOCK_CACHED;
+  r = prefixToRegion(p);
+  *(void **)r = bin->head;
+  bin->head = r;
+  bin->count++;
+  leaveAllocator();
+  return 1;
+}
 
+/* fork
 
+   prepareFork() takes every arena's lock and the chunk cache's right
+   before fork(), so the child can't inherit a lock held by a thread
+   it doesn't have, or an arena in the middle of a change; afterwards
+   the parent unlocks them and the child starts them over.  The shared
+   arena's lock is process-shared, so it is left alone: a child just
+   waits for a parent's thread to let go of it, like any other process
+   sharing it.  A heap file stays the parent's (its flock() is): the
+   child starts a fresh arena in anonymous memory.  Its view of the
+   heap is mapped again copy-on-write, so the regions it inherited can
+   still be used but what it writes to them stays its own; the child
+   never frees nor reuses them.  Pages it hasn't written still follow
+   the file, so they show what the parent writes later. */
 
+void *detachedHeap = 0;                 /* in a forked child: its parent's heap */
+size_t detachedLength = 0;
 
+void prepareFork() {
+  int node;
+  Arena_t *a;
+  for (node = 0; node < numNodes; node++)
+    for (a = &arenas[node]; a; a = a->next) /* (read once a is locked) */
+      lockArena(a);
+  enterAllocator();
+  pthread_mutex_lock(&chunkCacheLock);
+}
 
+void forkedParent() {
+  int node;
+  Arena_t *a;
+  pthread_mutex_unlock(&chunkCacheLock);
+  leaveAllocator();
+  for (node = numNodes - 1; node >= 0; node--)
+    for (a = &arenas[node]; a; a = a->next)
+      unlockArena(a);
+}
 
-int isEqual(BlockPrefix_t *left, BlockPrefix_t *right){
-  return ((long long)left == (long long) right);
+void detachHeapFile(Arena_t *a) { /* leave a's heap file to the parent */
+  size_t len = a->arenaEnd - (void *)a->heap;
+  if (mmap(a->heap, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, a->heapFd, 0)
+      == MAP_FAILED)
+    mprotect(a->heap, len, PROT_READ); /* at least don't write to the parent's */
+  __sync_fetch_and_add(&numSyscalls, 1);
+  detachedHeap = a->arenaBegin;
+  detachedLength = a->reserved;
+  close(a->heapFd);
+  memset(threadCache, 0, sizeof(threadCache)); /* the heap's blocks, all of them */
+  memset(a, 0, sizeof(*a));
+  heapFile = 0;
+  heapDisplacement = 0;
+  initializeArena(a, 0);
 }
 
-/* nextFitTracker  was created earlier to keep track of current slot*/  
-BlockPrefix_t *findNextFit(size_t s) { /* find first block with usable space > s */
-  //nextFitTracker
-  
-  int hasMadeCycle = 0;//used as boolean to check if has already looped 
-  BlockPrefix_t *p = nextFitTracker;
+void forkedChild() {            /* the forking thread is all that's left */
+  int node;
+  Arena_t *a;
+  pthread_mutex_init(&chunkCacheLock, 0);
+  leaveAllocator();
+  for (node = numNodes - 1; node >= 0; node--)
+    for (a = &arenas[node]; a; a = a->next) {
+      pthread_mutex_init(&a->state->lock, 0);
+      leaveAllocator();
+    }
+  if (arenas[0].heap)
+    detachHeapFile(&arenas[0]);
+}
 
-  while(!hasMadeCycle) {//check right half first
-    if (!p->allocated && computeUsableSpace(p) >= s){
-      nextFitTracker = p;
-      return p;
+/* allocate from a using fit policy find; always inlined, so each
+   policy gets its own copy that calls its find directly */
+static inline __attribute__((always_inline))
+void *arenaAllocRegion(Arena_t *a, size_t s, BlockPrefix_t *(*find)(Arena_t *, size_t)) {
+  BlockPrefix_t *p;
+  if (__builtin_expect(allocatorDepth != 0, 0)) /* a's lock may be this thread's */
+    return (void *)0;
+  if (__builtin_expect(s >= MMAP_THRESHOLD, 0)) {
+    if (!a->heap) {             /* too big for the arena */
+      void *r = mapAllocRegion(s, a->node);
+      if (r == 0)
+	allocEvent(ALLOC_EVENT_FAIL, a, s, 0);
+      return r;
     }
-    if(hasMadeCycle && isEqual(p, nextFitTracker)){
-      p = arenaBegin;
-      hasMadeCycle =1;
-      
+    if (s > a->reserved) {      /* heap file or shared arena: can never fit */
+      allocEvent(ALLOC_EVENT_FAIL, a, s, a->arenaEnd - (void *)a->arenaBegin);
+      return (void *)0;
     }
-    p = getNextPrefix(p);    
-    
   }
-  //after the first while loop we didnt find a valid spot
-  //with enough space so we need to check the left half
-  
+  for (;;) {                    /* a, then the node's arenas chained after it */
+    Arena_t *next;
+    size_t arenaSize;
+    if (__builtin_expect(!lockArena(a), 0)) {
+      allocEvent(ALLOC_EVENT_FAIL, a, s, 0);
+      return (void *)0;
+    }
+    if (__builtin_expect(!indexRoom(a, 2), 0)) /* a grown tail & a split's sliver */
+      p = 0;
+    else
+      p = find(a, s);           /* find a block */
+    if (__builtin_expect(p != 0, 1)) { /* found a block */
+      indexRemove(a, p);
+      splitBlock(a, p, align8(s));
+      p->allocated = BLOCK_ALLOCATED; /* mark as allocated */
+      a->state->numUsed++;
+      unlockArena(a);
+      return prefixToRegion(p); /* convert to *region */
+    }
+    next = a->heap || !reserveUsedUp(a, s) ? 0 : chainArena(a);
+    arenaSize = a->arenaEnd - (void *)a->arenaBegin;
+    unlockArena(a);
+    if (next == 0) {            /* failed */
+      allocEvent(ALLOC_EVENT_FAIL, a, s, arenaSize);
+      return (void *)0;
+    }
+    a = next;
+  }
+}
 
-  return growArena(s);
+static inline __attribute__((always_inline))
+void *policyAllocRegion(size_t s, BlockPrefix_t *(*find)(Arena_t *, size_t)) {
+  void *r;
+  if (s <= SMALL_MAX) {         /* common case: a cached small block */
+    r = takeCachedRegion(sizeClassOf[(s + 7) >> 3]);
+    if (r)
+      return noteRequest(r, s);
+  }
+  r = arenaAllocRegion(currentArena(), roundRequest(s), find);
+  if (__builtin_expect(r == 0, 0)) /* in a signal handler, or out of memory */
+    r = emergencyAllocRegion(s, allocatorDepth ? EMERGENCY_SLOTS : EMERGENCY_OOM_SLOTS);
+  return noteRequest(r, s);
 }
 
-void *nextFitAllocRegion(size_t s){
-  size_t asize = align8(s);
-  size_t availSize;
-  BlockPrefix_t *p;
-  if (arenaBegin == 0)          /* arena uninitialized? */
-    initializeArena();
-  p = findNextFit(s);          /* find a block */
-  if (p) {                      /* found a block */
-    availSize = computeUsableSpace(p);
-    if (availSize >= (asize + prefixSize + suffixSize + 8)) { /* split block? */
-      void *freeSliverStart = (void *)p + prefixSize + suffixSize + asize;
-      void *freeSliverEnd = computeNextPrefixAddr(p);
-      makeFreeBlock(freeSliverStart, freeSliverEnd - freeSliverStart);//right half
-      makeFreeBlock(p, freeSliverStart - (void *)p); /* piece being allocated left half */
+/* these really are equivalent to malloc & free */
+void *allocRegion(size_t s) {
+  return policyAllocRegion(s, ALLOC_POLICY);
+}
+
+void *firstFitAllocRegion(size_t s) {
+  return policyAllocRegion(s, findFirstFit);
+}
+
+void *bestFitAllocRegion(size_t s) {
+  return policyAllocRegion(s, findBestFit);
+}
+
+void *nextFitAllocRegion(size_t s) {
+  return policyAllocRegion(s, findNextFit);
+}
+
+void *nodeAllocRegion(size_t s, int node) { /* from node's arena, never cached */
+  void *r;
+  if (node < 0 || node >= numaNodeCount())
+    return (void *)0;
+  r = arenaAllocRegion(&arenas[node], roundRequest(s), ALLOC_POLICY);
+  if (__builtin_expect(r == 0, 0))
+    r = emergencyAllocRegion(s, allocatorDepth ? EMERGENCY_SLOTS : EMERGENCY_OOM_SLOTS);
+  return noteRequest(r, s);
+}
+
+void *sharedAllocRegion(size_t s) { /* from the shared arena, never cached */
+  if (sharedArena.heap == 0)
+    return (void *)0;
+  return noteRequest(arenaAllocRegion(&sharedArena, roundRequest(s), ALLOC_POLICY), s);
+}
+
+size_t sharedOffset(void *r) {  /* where r is in the shared arena, in any process */
+  return r - (void *)sharedArena.arenaBegin;
+}
+
+void *sharedRegion(size_t offset) { /* region at offset in this process */
+  return (void *)sharedArena.arenaBegin + offset;
+}
+
+void *heapRoot() {              /* region recorded by setHeapRoot(), 0 if none */
+  Arena_t *a = &arenas[0];
+  if (numaNodeCount() == 0 || a->heap == 0 || a->heap->root == 0)
+    return (void *)0;
+  return (void *)a->arenaBegin + a->heap->root;
+}
+
+/* how far the heap file was moved from where the last process had it
+   (0 if it wasn't): pointers stored in its regions are off by that
+   much, and must be fixed before this process ends, as the file now
+   records the new address */
+ptrdiff_t heapMoved() {
+  if (numaNodeCount() == 0 || arenas[0].heap == 0)
+    return 0;
+  return heapDisplacement;
+}
+
+int setHeapRoot(void *r) {      /* record r in the heap file, false if no heap file holds r */
+  Arena_t *a = &arenas[0];
+  if (numaNodeCount() == 0 || a->heap == 0 || (r && arenaOf(regionToPrefix(r)) != a))
+    return 0;
+  a->heap->root = r ? r - (void *)a->arenaBegin : 0;
+  return 1;
+}
+
+int regionNode(void *r) {       /* node r's memory is on */
+  BlockPrefix_t *p = regionToPrefix(r);
+  Arena_t *a;
+  if (p->allocated == BLOCK_MAPPED)
+    return p->node;
+  a = arenaOf(p);
+  return a ? a->node : 0;       /* emergency pool, or a parent's heap file */
+}
+
+size_t usableSpaceRegion(void *r) { /* equivalent to malloc_usable_size */
+  return computeUsableSpace(regionToPrefix(r));
+}
+
+void drainDeferredFrees() {      /* free what signal handlers couldn't */
+  void *r = __sync_lock_test_and_set(&deferredFrees, 0);
+  while (r) {
+    void *next = *(void **)r;
+    freeRegion(r);
+    r = next;
+  }
+}
+
+void freeRegion(void *r) {
+  if (r != 0) {
+    BlockPrefix_t *p = regionToPrefix(r); /* convert to block */
+    if (__builtin_expect(p->allocated == BLOCK_EMERGENCY, 0)) {
+      emergencyFree(p);
+      return;
     }
-    p->allocated = 1;           /* mark as allocated */
-    return prefixToRegion(p);   /* convert to *region */
-  } else {                      /* failed */
-    BlockPrefix_t *tryer = arenaBegin;
-    availSize = computeUsableSpace(tryer);
-    printf("**FAILED** to find and empty continuous size of %d   ONLY HAVE %d\n",s, availSize);
+    if (__builtin_expect(allocatorDepth != 0, 0)) { /* can't lock now */
+      deferFree(r);
+      return;
+    }
+    if (__builtin_expect(deferredFrees != 0, 0))
+      drainDeferredFrees();
+    if (p->allocated == BLOCK_MAPPED) { /* has its own mapping */
+      size_t len = computeMappedLength(p);
+      if (!cacheChunk(p, len, p->node)) {
+	munmap(p, len);
+	__sync_fetch_and_add(&numSyscalls, 1);
+      }
+      return;
+    }
+    if (__builtin_expect((size_t)((void *)p - detachedHeap) < detachedLength, 0))
+      return;                   /* the parent's heap file: see "fork" */
+    if (!inSharedArena(p) && cacheRegion(p)) /* kept for this thread's next malloc */
+      return;
+    freeArenaBlock(p);
+  }
+}
+
+
+/* how much to ask for when a region must move to hold newSize:
+   twice what is needed (up to the mapping threshold) so that a growing
+   region is copied O(log n) times, not every time.  Unlike big
+   regions, which mremap() grows without copying, an arena region
+   can't grow past its neighbour, so this is committed memory and the
+   moves are still copies: a region that moves once, never to grow
+   again, holds up to twice what it needs until freed */
+size_t reallocGrowthSize(size_t newSize) {
+  size_t reserve = 2 * newSize;
+  if (newSize >= MMAP_THRESHOLD) /* mremap() grows these without copying */
+    return newSize;
+  if (reserve >= MMAP_THRESHOLD)
+    reserve = MMAP_THRESHOLD - 8;
+  return reserve;
+}
+
+/* equivalent to realloc: resize in place if possible, otherwise move */
+void *reallocRegion(void *r, size_t newSize) {
+  void *(*alloc)(size_t);
+  size_t oldSize;
+  void *n;
+  if (r == (void *)0)
+    return allocRegion(newSize);
+  if (newSize == 0) {
+    freeRegion(r);
     return (void *)0;
   }
+  n = resizeRegion(r, newSize);
+  if (n)                        /* grew (or shrank) in place or via mremap */
+    return n;
+  oldSize = computeUsableSpace(regionToPrefix(r)); /* all of it may have been written */
+  alloc = inSharedArena(regionToPrefix(r)) ? sharedAllocRegion : allocRegion; /* stay there */
+  n = alloc(reallocGrowthSize(newSize));
+  if (n == (void *)0)
+    n = alloc(newSize);         /* no room for slack, try exact */
+  if (n == (void *)0)
+    return (void *)0;
+  memcpy(n, r, oldSize < newSize ? oldSize : newSize);
+  freeRegion(r);
+  return noteRequest(n, newSize);
 }
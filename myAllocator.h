@@ -1,6 +1,68 @@
 #include <stdlib.h>
+#include <stddef.h>
+void *allocRegion(size_t s);
 void *firstFitAllocRegion(size_t s);
 void freeRegion(void *r);
 void *resizeRegion(void *r, size_t newSize);
 void printBlockInfo();
 void *bestFitAllocRegion(size_t s);
+void *reallocRegion(void *r, size_t newSize);
+void *nodeAllocRegion(size_t s, int node);
+int regionNode(void *r);
+int currentNode();
+int numaNodeCount();
+void arenaCheck();
+void *malloc_on_node(size_t NBYTES, int NODE);
+size_t allocatorSyscalls();
+size_t usableSpaceRegion(void *r);
+void *nextFitAllocRegion(size_t s);
+void *heapRoot();
+int setHeapRoot(void *r);
+ptrdiff_t heapMoved();
+int shareArena(int fd, size_t size);
+void *sharedAllocRegion(size_t s);
+size_t sharedOffset(void *r);
+void *sharedRegion(size_t offset);
+void *malloc_shared(size_t NBYTES);
+
+/* allocator events: a hook set with setAllocHook() is called as
+   hook(event, node, size, extra), possibly with an arena locked, so
+   what it allocates comes from the small emergency pool (as in signal
+   handlers interrupting malloc or free) */
+#define ALLOC_EVENT_GROW 0              /* arena committed size bytes, now extra */
+#define ALLOC_EVENT_FAIL 1              /* no room for size bytes; arena has extra */
+#define ALLOC_EVENT_TRIM 2              /* arena released size bytes, now extra */
+#define ALLOC_EVENT_SPLIT 3             /* size byte block split to hold extra */
+#define ALLOC_EVENT_COALESCE 4          /* freed blocks merged into size bytes */
+#define NUM_ALLOC_EVENTS 5
+
+typedef void (*AllocHook_t)(int event, int node, size_t size, size_t extra);
+AllocHook_t setAllocHook(AllocHook_t hook);
+unsigned int takeAllocEvents();         /* this thread's events (bit each) since last call */
+
+/* latency histograms, kept by malloc.c when built with LATENCY=1 */
+#define MALLOC_OP_MALLOC 0
+#define MALLOC_OP_FREE 1
+#define MALLOC_OP_REALLOC 2
+#define NUM_MALLOC_OPS 3
+#define LATENCY_BUCKETS 40              /* bucket b: ops of 2^(b-1) to 2^b cycles */
+
+typedef struct LatencyHistogram_s {
+  size_t count[NUM_MALLOC_OPS][LATENCY_BUCKETS];
+  size_t withEvent[NUM_MALLOC_OPS][NUM_ALLOC_EVENTS][LATENCY_BUCKETS]; /* of those, ops hitting event */
+} LatencyHistogram_t;
+
+int mallocLatencyStats(LatencyHistogram_t *h); /* false if not kept */
+
+typedef struct FragmentationStats_s {
+  size_t requested;             /* bytes asked for by live regions */
+  size_t allocated;             /* usable bytes of live regions */
+  size_t internal;              /* allocated - requested: size class rounding */
+  size_t free;                  /* free bytes in arenas */
+  size_t freeBlocks;            /* number of free blocks */
+  size_t largestFree;           /* biggest free block */
+  size_t external;              /* free bytes outside the largest free block */
+  size_t cached;                /* bytes of freed regions in thread caches */
+} FragmentationStats_t;
+
+void fragmentationStats(FragmentationStats_t *st);
@@ -0,0 +1,82 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "myAllocator.h"
+#include <assert.h>
+#include <pthread.h>
+
+/* next fit moves on from where it left off, wraps around at the
+   arena's end, and keeps working while threads free around it */
+
+#define NUM_THREADS 4
+#define ROUNDS 2000
+#define BATCH 50
+
+int grows = 0;
+void *fillers[1000];
+
+void countGrows(int event, int node, size_t size, size_t extra) {
+  if (event == ALLOC_EVENT_GROW)
+    grows++;
+}
+
+size_t largestFree() {
+  FragmentationStats_t st;
+  fragmentationStats(&st);
+  return st.largestFree;
+}
+
+void *churn(void *seed) {       /* allocate & free near each other */
+  void *regions[BATCH];
+  unsigned int r = (size_t)seed;
+  int round, i;
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < BATCH; i++)
+      regions[i] = nextFitAllocRegion(300 + rand_r(&r) % 3000);
+    for (i = 0; i < BATCH; i++)
+      freeRegion(regions[BATCH - 1 - i]);
+  }
+  return 0;
+}
+
+int main() 
+{
+  char *a, *b, *c, *d, *e;
+  size_t hole, left;
+  pthread_t threads[NUM_THREADS];
+  int i, n = 0, before;
+  printf("next fit wraps around & survives coalescing\n"); /* stdout's buffer */
+  if (numaNodeCount() > 1) {    /* largestFree() below needs a single arena */
+    printf("skipped: more than one arena\n");
+    return 0;
+  }
+  a = nextFitAllocRegion(50000);
+  b = nextFitAllocRegion(5000);
+  c = nextFitAllocRegion(5000);
+  assert(a < b && b < c);
+  hole = usableSpaceRegion(a);
+  freeRegion(a);
+  d = nextFitAllocRegion(5000); /* not back into a's hole */
+  assert(d > c);
+
+  setAllocHook(countGrows);
+  while ((left = largestFree()) > hole) /* use up the arena's end */
+    fillers[n++] = nextFitAllocRegion(left / 2 < 100000 ? left / 2 : 100000);
+  before = grows;
+  e = nextFitAllocRegion(hole); /* only a's hole is left: wrap around */
+  assert(e != 0 && e <= a && grows == before);
+  setAllocHook(0);
+  freeRegion(e);
+  freeRegion(b);                /* a's hole, b & c merge under the cursor */
+  freeRegion(c);
+  freeRegion(d);
+  for (i = 0; i < n; i++)
+    freeRegion(fillers[i]);
+  arenaCheck();                 /* cursors still on block boundaries */
+
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_create(&threads[i], 0, churn, (void *)(size_t)(i + 1));
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_join(threads[i], 0);
+  arenaCheck();
+  return 0;
+}
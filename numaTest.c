@@ -0,0 +1,85 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "myAllocator.h"
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* run with MYALLOC_NUMA_NODES=n to simulate n nodes on any machine;
+   without it, it runs on the real nodes and then on 2 simulated ones */
+
+#define NUM_THREADS 4
+
+void *regions[64];
+
+void *freeRegions(void *arg) {  /* free another thread's (node's) regions */
+  int node;
+  for (node = 0; node < numaNodeCount(); node++)
+    free(regions[node]);
+  return 0;
+}
+
+void *allocLocal(void *arg) {   /* blocks should come from the local node */
+  int i, misses = 0;
+  for (i = 0; i < 1000; i++) {
+    int node = currentNode();
+    void *p = malloc(100);
+    if (regionNode(p) != node)  /* only if migrated in between */
+      misses++;
+    free(p);
+  }
+  return (void *)(long)misses;
+}
+
+int simulateTwoNodes(char *self) { /* exit status of self with MYALLOC_NUMA_NODES=2 */
+  char *argv[] = { self, 0 };
+  char *envp[] = { "MYALLOC_NUMA_NODES=2", 0 };
+  int status;
+  pid_t pid = fork();
+  if (pid == 0) {
+    execve(self, argv, envp);
+    _exit(127);
+  }
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, char **argv) 
+{
+  int node, i, nodes = numaNodeCount();
+  pthread_t threads[NUM_THREADS];
+  long misses = 0;
+  printf("%d nodes, main thread on node %d\n", nodes, currentNode());
+  for (node = 0; node < nodes; node++) {
+    regions[node] = malloc_on_node(1000, node);
+    assert(regions[node] != 0);
+    assert(regionNode(regions[node]) == node);
+  }
+  assert(malloc_on_node(1000, nodes) == 0); /* no such node */
+  for (node = 0; node < nodes; node++) { /* a freed block isn't handed to another node */
+    void *r = malloc_on_node(100, node), *q;
+    int here = currentNode();
+    free(r);
+    q = malloc(100);
+    assert(q != r || here == node || currentNode() == node); /* or migrated */
+    free(q);
+  }
+  pthread_create(&threads[0], 0, freeRegions, 0);
+  pthread_join(threads[0], 0);
+  arenaCheck();
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_create(&threads[i], 0, allocLocal, 0);
+  for (i = 0; i < NUM_THREADS; i++) {
+    void *m;
+    pthread_join(threads[i], &m);
+    misses += (long)m;
+  }
+  printf("%ld of %d allocations not node-local\n", misses, NUM_THREADS * 1000);
+  arenaCheck();
+  if (getenv("MYALLOC_NUMA_NODES") == 0) {
+    fflush(stdout);
+    assert(simulateTwoNodes(argv[0]) == 0);
+  }
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdint.h"
+#include "myAllocator.h"
+#include <assert.h>
+
+/* regions grow by mremap() or amortized copies; impossible sizes fail */
+
+#define BLOCKERS 2001
+
+void *blockers[BLOCKERS];
+volatile size_t huge = SIZE_MAX; /* volatile: the compiler knows SIZE_MAX won't fit */
+char *volatile old;             /* or the compiler assumes realloc() moved it */
+char *volatile blocker;         /* or the compiler drops its malloc() */
+
+int main()
+{
+  char *r, *p, *q;
+  size_t s;
+  int moves = 0;
+  printf("realloc grows regions, and refuses impossible sizes\n"); /* stdout's buffer */
+  r = old = malloc(65);         /* all its usable space moves with it */
+  memset(r, 9, usableSpaceRegion(r));
+  blocker = malloc(65);         /* right after r in the fresh arena */
+  s = usableSpaceRegion(r);
+  q = realloc(r, 4000);
+  assert(q && q != old && q[s - 1] == 9 && q[64] == 9);
+  free(q);
+  free(blocker);
+  assert(malloc(huge) == 0);
+  assert(malloc(huge - 10) == 0);
+  r = malloc(1 << 20);          /* a mapping of its own */
+  memset(r, 7, 1 << 20);
+  assert(realloc(r, huge - 10) == 0); /* r is left as it was */
+  assert(usableSpaceRegion(r) >= 1 << 20 && r[0] == 7 && r[(1 << 20) - 1] == 7);
+  r = realloc(r, 64 << 20);     /* mremap() */
+  assert(r && r[(1 << 20) - 1] == 7);
+  free(r);
+  r = malloc((size_t)3 << 30);  /* sizes past 2G, which don't fit in an int */
+  if (r) {                      /* (pages never touched aren't memory) */
+    r[0] = 5;
+    r = realloc(r, (size_t)4 << 30);
+    assert(r && usableSpaceRegion(r) >= (size_t)4 << 30 && r[0] == 5);
+    r[((size_t)4 << 30) - 1] = 5;
+    free(r);
+  }
+
+  r = malloc(100);
+  for (s = 200; s <= 200000; s += 100) { /* growing by little steps */
+    memset(r, 1, s - 100);
+    p = realloc(r, s);
+    assert(p && p[s - 101] == 1);
+    if (p != r)
+      moves++;
+    r = p;
+    blockers[s / 100] = malloc(100); /* often right after r, so it can't just grow */
+  }
+  free(r);
+  for (s = 0; s < BLOCKERS; s++)
+    free(blockers[s]);
+  assert(moves < 40);           /* O(log n), not one per step */
+  printf("grew 100 -> 200000 bytes in 100 byte steps, moving %d times\n", moves);
+  arenaCheck();
+  return 0;
+}
@@ -0,0 +1,117 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "myAllocator.h"
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* cycles per search of a fragmented arena: BLOCKS blocks of
+   MIN_SIZE..MAX_SIZE bytes with every other one freed, so first &
+   best fit have BLOCKS/2 holes to choose from ("no hole": only the
+   free space at the arena's end fits) */
+
+#define BLOCKS 20000
+#define MIN_SIZE 300            /* above the per-thread caches */
+#define MAX_SIZE 4000
+#define SEARCHES 20000
+
+void *regions[BLOCKS];
+
+unsigned long long readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else                           /* no cycle counter: nanoseconds instead */
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+void fragment() {
+  int i;
+  srand(1);
+  for (i = 0; i < BLOCKS; i++)
+    regions[i] = firstFitAllocRegion(MIN_SIZE + rand() % (MAX_SIZE - MIN_SIZE + 1));
+  for (i = 0; i < BLOCKS; i += 2)
+    freeRegion(regions[i]);
+}
+
+/* allocate & free right away, so the arena stays as fragmented */
+void measure(const char *name, void *(*alloc)(size_t), size_t minSize, size_t maxSize) {
+  unsigned long long cycles = 0, t;
+  int i;
+  srand(2);
+  for (i = 0; i < SEARCHES; i++) {
+    size_t s = minSize + rand() % (maxSize - minSize + 1);
+    void *r;
+    t = readCycles();
+    r = alloc(s);
+    cycles += readCycles() - t;
+    freeRegion(r);
+  }
+  printf("%-32s %10.1f cycles/alloc\n", name, (double)cycles / SEARCHES);
+}
+
+/* locality: how far apart a thread's consecutive allocations land
+   while NUM_THREADS threads allocate & free at once */
+
+#define NUM_THREADS 4
+#define LOCALITY_ROUNDS 200
+#define LOCALITY_BATCH 100
+
+void *(*localityAlloc)(size_t);
+
+void *localityThread(void *seed) {
+  void *regions[LOCALITY_BATCH];
+  unsigned int r = (size_t)seed;
+  double distance = 0;
+  int round, i;
+  for (round = 0; round < LOCALITY_ROUNDS; round++) {
+    for (i = 0; i < LOCALITY_BATCH; i++) {
+      regions[i] = localityAlloc(MIN_SIZE + rand_r(&r) % (MAX_SIZE - MIN_SIZE + 1));
+      if (i > 0)
+	distance += labs((char *)regions[i] - (char *)regions[i - 1]);
+    }
+    for (i = 0; i < LOCALITY_BATCH; i += 2) /* leave every other one */
+      freeRegion(regions[i]);
+    for (i = 1; i < LOCALITY_BATCH; i += 2)
+      freeRegion(regions[i]);
+  }
+  distance /= LOCALITY_ROUNDS * (LOCALITY_BATCH - 1);
+  return (void *)(size_t)distance;
+}
+
+void locality(const char *name, void *(*alloc)(size_t)) {
+  pthread_t threads[NUM_THREADS];
+  size_t distance = 0;
+  void *d;
+  int i;
+  localityAlloc = alloc;
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_create(&threads[i], 0, localityThread, (void *)(size_t)(i + 1));
+  for (i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], &d);
+    distance += (size_t)d;
+  }
+  printf("%-32s %10lu bytes between a thread's allocations\n", name,
+	 (unsigned long)distance / NUM_THREADS);
+}
+
+int main() 
+{
+  fragment();
+  measure("first fit, any hole (300-4000)", firstFitAllocRegion, MIN_SIZE, MAX_SIZE);
+  measure("first fit, big holes (3500-4000)", firstFitAllocRegion, 3500, MAX_SIZE);
+  measure("first fit, no hole (8000)", firstFitAllocRegion, 8000, 8000);
+  measure("best fit, any hole (300-4000)", bestFitAllocRegion, MIN_SIZE, MAX_SIZE);
+  measure("best fit, big holes (3500-4000)", bestFitAllocRegion, 3500, MAX_SIZE);
+  measure("best fit, no hole (8000)", bestFitAllocRegion, 8000, 8000);
+  measure("next fit, any hole (300-4000)", nextFitAllocRegion, MIN_SIZE, MAX_SIZE);
+  measure("next fit, big holes (3500-4000)", nextFitAllocRegion, 3500, MAX_SIZE);
+  measure("next fit, no hole (8000)", nextFitAllocRegion, 8000, 8000);
+  locality("first fit, 4 threads", firstFitAllocRegion);
+  locality("next fit, 4 threads", nextFitAllocRegion);
+  return 0;
+}
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE             /* for memfd_create() */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "myAllocator.h"
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* several processes allocating from one shared arena, and buffers
+   handed from a producer process to a consumer by offset (zero copy)
+   versus copied through a pipe */
+
+#define ARENA_SIZE (256 << 20)
+#define ROUNDS 2000
+#define BATCH 100
+#define HANDOFFS 100000
+#define WINDOW 1024             /* most buffers in flight */
+#define ACK_EVERY 64
+
+double seconds() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void churn(int seed) {          /* one process' share of the contention test */
+  void *regions[BATCH];
+  int round, i;
+  srand(seed);
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < BATCH; i++)
+      regions[i] = sharedAllocRegion(64 + rand() % 4033);
+    for (i = 0; i < BATCH; i++)
+      freeRegion(regions[i]);
+  }
+}
+
+void contention(int processes) {
+  double t = seconds();
+  int p;
+  for (p = 0; p < processes; p++)
+    if (fork() == 0) {
+      churn(p + 1);
+      _exit(0);
+    }
+  for (p = 0; p < processes; p++)
+    wait(0);
+  t = seconds() - t;
+  printf("%d process(es) sharing the arena   %8.2f M malloc+free/s\n", processes,
+	 (double)processes * ROUNDS * BATCH / t / 1e6);
+}
+
+/* producer fills size byte buffers, consumer reads & drops them */
+void handoff(size_t size, int zeroCopy) {
+  int fds[2], acks[2];
+  char *buf = malloc(size), ack = 0;
+  double t;
+  int i;
+  pipe(fds);
+  pipe(acks);
+  t = seconds();
+  if (fork() == 0) {            /* consumer */
+    close(fds[1]);
+    for (i = 0; i < HANDOFFS; i++) {
+      size_t offset;
+      if (zeroCopy) {
+	read(fds[0], &offset, sizeof(offset));
+	buf = sharedRegion(offset);
+      } else {
+	size_t got = 0;
+	while (got < size)
+	  got += read(fds[0], buf + got, size - got);
+      }
+      if (buf[0] != buf[size - 1])
+	_exit(1);
+      if (zeroCopy)
+	freeRegion(buf);
+      if (i % ACK_EVERY == ACK_EVERY - 1)
+	write(acks[1], &ack, 1);
+    }
+    _exit(0);
+  }
+  close(fds[0]);
+  for (i = 0; i < HANDOFFS; i++) { /* producer */
+    if (i >= WINDOW && i % ACK_EVERY == 0) /* keep the arena from filling up */
+      read(acks[0], &ack, 1);
+    if (zeroCopy) {
+      size_t offset;
+      char *r = sharedAllocRegion(size);
+      r[0] = r[size - 1] = i;
+      offset = sharedOffset(r);
+      write(fds[1], &offset, sizeof(offset));
+    } else {
+      buf[0] = buf[size - 1] = i;
+      write(fds[1], buf, size);
+    }
+  }
+  close(fds[1]);
+  wait(0);
+  close(acks[0]);
+  close(acks[1]);
+  t = seconds() - t;
+  printf("%6luk buffers, %-20s %8.2f k handoffs/s\n", (unsigned long)size / 1024,
+	 zeroCopy ? "by shared offset" : "copied through pipe", HANDOFFS / t / 1e3);
+  free(buf);
+}
+
+int main() 
+{
+  int fd = memfd_create("sharedBench", 0);
+  if (fd < 0 || !shareArena(fd, ARENA_SIZE)) {
+    printf("can't share an arena\n");
+    return 1;
+  }
+  contention(1);
+  contention(2);
+  contention(4);
+  handoff(4096, 0);
+  handoff(4096, 1);
+  handoff(65536, 0);
+  handoff(65536, 1);
+  return 0;
+}
@@ -0,0 +1,107 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "myAllocator.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* two unrelated processes share an arena: each frees what the other
+   allocated, finding it by offset (its address may differ) */
+
+#define NUM_REGIONS 100
+#define ARENA_SIZE (16 << 20)
+
+size_t offsets[NUM_REGIONS];
+
+void dieHalfway(int event, int node, size_t size, size_t extra) {
+  if (event == ALLOC_EVENT_SPLIT) /* the block being split is in no state to leave */
+    _exit(0);
+}
+
+size_t regionSize(int i) { return 1 + i * 37; }
+
+void fill(void *r, int i) { memset(r, i, regionSize(i)); }
+
+void check(void *r, int i) {
+  unsigned char *c = r;
+  size_t j;
+  for (j = 0; j < regionSize(i); j++)
+    assert(c[j] == (unsigned char)i);
+}
+
+int child(char *name) {         /* free the parent's regions, allocate some back */
+  int fd = shm_open(name, O_RDWR, 0);
+  int i;
+  assert(fd >= 0 && shareArena(fd, 0));
+  assert(read(0, offsets, sizeof(offsets)) == sizeof(offsets));
+  for (i = 0; i < NUM_REGIONS; i++) {
+    check(sharedRegion(offsets[i]), i);
+    freeRegion(sharedRegion(offsets[i]));
+  }
+  for (i = 0; i < NUM_REGIONS; i++) {
+    void *r = sharedAllocRegion(regionSize(i));
+    fill(r, i);
+    offsets[i] = sharedOffset(r);
+  }
+  assert(write(1, offsets, sizeof(offsets)) == sizeof(offsets));
+  return 0;
+}
+
+int main(int argc, char **argv) 
+{
+  char name[64];
+  int toChild[2], fromChild[2], status, fd, i;
+  pid_t pid;
+  void *big;
+  if (argc > 2 && strcmp(argv[1], "child") == 0)
+    return child(argv[2]);
+  sprintf(name, "/sharedTest.%d", (int)getpid());
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  assert(fd >= 0 && !shareArena(fd, (size_t)1 << 31)); /* offsets wouldn't fit an int */
+  assert(!shareArena(fd, (size_t)3 << 30) && !shareArena(fd, 0));
+  assert(fd >= 0 && shareArena(fd, ARENA_SIZE));
+  for (i = 0; i < NUM_REGIONS; i++) {
+    void *r = malloc_shared(regionSize(i));
+    fill(r, i);
+    offsets[i] = sharedOffset(r);
+  }
+  assert(pipe(toChild) == 0 && pipe(fromChild) == 0);
+  pid = fork();
+  if (pid == 0) {               /* a new program: its own mapping of the segment */
+    char *args[] = { argv[0], "child", name, 0 };
+    dup2(toChild[0], 0);
+    dup2(fromChild[1], 1);
+    close(fd);
+    execv(argv[0], args);
+    _exit(127);
+  }
+  assert(write(toChild[1], offsets, sizeof(offsets)) == sizeof(offsets));
+  assert(read(fromChild[0], offsets, sizeof(offsets)) == sizeof(offsets));
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(malloc_shared(((size_t)1 << 32) + 64) == 0); /* sizes the index can't hold */
+  assert(malloc_shared(((size_t)1 << 31) + 64) == 0);
+  for (i = 0; i < NUM_REGIONS; i++) {
+    check(sharedRegion(offsets[i]), i);
+    free(sharedRegion(offsets[i]));
+  }
+  pid = fork();
+  if (pid == 0) {               /* dies holding the arena's lock */
+    setAllocHook(dieHalfway);
+    malloc_shared(100);
+    _exit(1);
+  }
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  free(malloc_shared(100));     /* repairs the arena first */
+  arenaCheck();
+  big = malloc_shared(ARENA_SIZE - 4096); /* everything coalesced again */
+  assert(big != 0);
+  free(big);
+  shm_unlink(name);
+  printf("regions allocated & freed across processes\n");
+  return 0;
+}